@@ -0,0 +1,283 @@
+#include "alsa.h"
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+struct alsa_s
+{
+    snd_pcm_t* handle;
+    unsigned int rate;
+    unsigned int channels;
+    snd_pcm_uframes_t period;
+    snd_pcm_uframes_t buffer;
+
+    struct pollfd* fds;
+    int nfds;
+};
+
+static int alsa_sethw(struct alsa_s* alsa, unsigned int latency_ms)
+{
+    snd_pcm_hw_params_t* hw = NULL;
+    int dir = 0;
+    int rtn;
+
+    if((rtn = snd_pcm_hw_params_malloc(&hw)) < 0)
+        return rtn;
+
+    if((rtn = snd_pcm_hw_params_any(alsa->handle, hw)) < 0)
+        goto hw_error;
+
+    if((rtn = snd_pcm_hw_params_set_access(alsa->handle, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0)
+        goto hw_error;
+
+    if((rtn = snd_pcm_hw_params_set_format(alsa->handle, hw, SND_PCM_FORMAT_S16_LE)) < 0)
+        goto hw_error;
+
+    if((rtn = snd_pcm_hw_params_set_channels(alsa->handle, hw, alsa->channels)) < 0)
+        goto hw_error;
+
+    if((rtn = snd_pcm_hw_params_set_rate_near(alsa->handle, hw, &alsa->rate, 0)) < 0)
+        goto hw_error;
+
+    // sizes in frames at the rate actually granted
+    alsa->buffer = (snd_pcm_uframes_t)alsa->rate * latency_ms / 1000;
+    if(alsa->buffer < ALSA_PERIODS)
+        alsa->buffer = ALSA_PERIODS;
+
+    if((rtn = snd_pcm_hw_params_set_buffer_size_near(alsa->handle, hw, &alsa->buffer)) < 0)
+        goto hw_error;
+
+    alsa->period = alsa->buffer / ALSA_PERIODS;
+    if((rtn = snd_pcm_hw_params_set_period_size_near(alsa->handle, hw, &alsa->period, &dir)) < 0)
+        goto hw_error;
+
+    if((rtn = snd_pcm_hw_params(alsa->handle, hw)) < 0)
+        goto hw_error;
+
+    // what the device finally settled on
+    snd_pcm_hw_params_get_period_size(hw, &alsa->period, &dir);
+    snd_pcm_hw_params_get_buffer_size(hw, &alsa->buffer);
+
+hw_error:
+    snd_pcm_hw_params_free(hw);
+    return rtn;
+}
+
+static int alsa_setsw(struct alsa_s* alsa)
+{
+    snd_pcm_sw_params_t* sw = NULL;
+    int rtn;
+
+    if((rtn = snd_pcm_sw_params_malloc(&sw)) < 0)
+        return rtn;
+
+    if((rtn = snd_pcm_sw_params_current(alsa->handle, sw)) < 0)
+        goto sw_error;
+
+    // start once the buffer is full, wake up whenever a period is free
+    if((rtn = snd_pcm_sw_params_set_start_threshold(alsa->handle, sw, (alsa->buffer/alsa->period)*alsa->period)) < 0)
+        goto sw_error;
+
+    if((rtn = snd_pcm_sw_params_set_avail_min(alsa->handle, sw, alsa->period)) < 0)
+        goto sw_error;
+
+    rtn = snd_pcm_sw_params(alsa->handle, sw);
+
+sw_error:
+    snd_pcm_sw_params_free(sw);
+    return rtn;
+}
+
+// 'device' NULL for the default one
+struct alsa_s* alsa_open(const char* device, unsigned int rate, unsigned int channels, unsigned int latency_ms)
+{
+    struct alsa_s* alsa;
+    int rtn;
+
+    alsa = calloc(1, sizeof(struct alsa_s));
+    if(!alsa)
+        return NULL;
+
+    alsa->rate = rate;
+    alsa->channels = channels;
+
+    if((rtn = snd_pcm_open(&alsa->handle, device ? device : "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+    {
+        alsa->handle = NULL;
+        goto open_error;
+    }
+
+    if((rtn = alsa_sethw(alsa, latency_ms)) < 0)
+        goto open_error;
+
+    if((rtn = alsa_setsw(alsa)) < 0)
+        goto open_error;
+
+    alsa->nfds = snd_pcm_poll_descriptors_count(alsa->handle);
+    if(alsa->nfds > 0)
+    {
+        alsa->fds = malloc(alsa->nfds * sizeof(struct pollfd));
+        if(!alsa->fds)
+        {
+            rtn = -ENOMEM;
+            goto open_error;
+        }
+
+        if((rtn = snd_pcm_poll_descriptors(alsa->handle, alsa->fds, alsa->nfds)) < 0)
+            goto open_error;
+    }
+
+    return alsa;
+
+open_error:
+    fprintf(stderr, "ALSA: %s\n", snd_strerror(rtn));
+    alsa_close(alsa);
+    return NULL;
+}
+
+void alsa_close(struct alsa_s* alsa)
+{
+    if(alsa == NULL)
+        return;
+
+    if(alsa->handle != NULL)
+        snd_pcm_close(alsa->handle);
+
+    free(alsa->fds);
+    free(alsa);
+}
+
+unsigned int alsa_rate(struct alsa_s* alsa)
+{
+    return alsa->rate;
+}
+
+uint32_t alsa_period(struct alsa_s* alsa)
+{
+    return alsa->period;
+}
+
+uint32_t alsa_buffer(struct alsa_s* alsa)
+{
+    return alsa->buffer;
+}
+
+// sleep until the device has room for a period or wants attention. an
+// error on the device returns 0 as well, alsa_write() finds the xrun or
+// suspend in the stream state and recovers from it.
+static int alsa_wait(struct alsa_s* alsa)
+{
+    unsigned short revents;
+    int rtn;
+
+    if(alsa->nfds <= 0)
+    {
+        rtn = snd_pcm_wait(alsa->handle, -1);
+        return (rtn < 0) ? rtn : 0;
+    }
+
+    for(;;)
+    {
+        if(poll(alsa->fds, alsa->nfds, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        snd_pcm_poll_descriptors_revents(alsa->handle, alsa->fds, alsa->nfds, &revents);
+
+        if(revents & (POLLERR|POLLOUT))
+            return 0;
+    }
+}
+
+// copy 'frames' frames into the DMA buffer, waiting for room as needed.
+// returns 0, or a negative ALSA error the device could not recover from.
+int alsa_write(struct alsa_s* alsa, const int16_t* buffer, uint32_t frames)
+{
+    const snd_pcm_channel_area_t* areas;
+    snd_pcm_uframes_t offset, size;
+    snd_pcm_sframes_t avail, committed;
+    snd_pcm_state_t state;
+    int16_t* dst;
+    int rtn;
+
+    while(frames > 0)
+    {
+        state = snd_pcm_state(alsa->handle);
+        if(state == SND_PCM_STATE_XRUN)
+        {
+            if((rtn = snd_pcm_recover(alsa->handle, -EPIPE, 1)) < 0)
+                return rtn;
+            continue;
+        }
+
+        avail = snd_pcm_avail_update(alsa->handle);
+        if(avail < 0)
+        {
+            if((rtn = snd_pcm_recover(alsa->handle, avail, 1)) < 0)
+                return rtn;
+            continue;
+        }
+
+        if(((snd_pcm_uframes_t)avail < alsa->period) && ((snd_pcm_uframes_t)avail < frames))
+        {
+            // a stream that has not started yet only fills up, it never
+            // frees room by itself
+            if(state == SND_PCM_STATE_PREPARED)
+            {
+                if(avail == 0 && (rtn = snd_pcm_start(alsa->handle)) < 0)
+                    return rtn;
+                if(avail == 0)
+                    continue;
+            }
+            else
+            {
+                if((rtn = alsa_wait(alsa)) < 0)
+                {
+                    if((rtn = snd_pcm_recover(alsa->handle, rtn, 1)) < 0)
+                        return rtn;
+                }
+                continue;
+            }
+        }
+
+        size = (frames < (snd_pcm_uframes_t)avail) ? frames : (snd_pcm_uframes_t)avail;
+        if((rtn = snd_pcm_mmap_begin(alsa->handle, &areas, &offset, &size)) < 0)
+        {
+            if((rtn = snd_pcm_recover(alsa->handle, rtn, 1)) < 0)
+                return rtn;
+            continue;
+        }
+
+        // interleaved, so all channels live in the first area
+        dst = (int16_t*)((char*)areas[0].addr + (areas[0].first>>3) + offset*(areas[0].step>>3));
+        memcpy(dst, buffer, size*alsa->channels*sizeof(int16_t));
+
+        committed = snd_pcm_mmap_commit(alsa->handle, offset, size);
+        if(committed < 0)
+        {
+            if((rtn = snd_pcm_recover(alsa->handle, committed, 1)) < 0)
+                return rtn;
+            continue;
+        }
+
+        buffer += committed*alsa->channels;
+        frames -= committed;
+    }
+
+    return 0;
+}
+
+// play out whatever is still buffered
+void alsa_drain(struct alsa_s* alsa)
+{
+    if(snd_pcm_state(alsa->handle) == SND_PCM_STATE_PREPARED)
+        snd_pcm_start(alsa->handle);
+
+    snd_pcm_drain(alsa->handle);
+}
@@ -0,0 +1,26 @@
+#ifndef ALSA_H_INCLUDED
+#define ALSA_H_INCLUDED
+
+#include <stdint.h>
+
+// Low latency ALSA playback of interleaved signed 16 bit samples. Period
+// and buffer sizes are negotiated in frames from a target latency, samples
+// are copied straight into the mmap'ed DMA area, and waiting for room is
+// done with poll() rather than spinning.
+
+#define ALSA_LATENCY_MS 5   // default target latency, the whole device buffer
+#define ALSA_PERIODS    2   // periods per buffer
+
+struct alsa_s;
+
+struct alsa_s* alsa_open(const char* device, unsigned int rate, unsigned int channels, unsigned int latency_ms);
+void alsa_close(struct alsa_s* alsa);
+
+unsigned int alsa_rate(struct alsa_s* alsa);
+uint32_t alsa_period(struct alsa_s* alsa);
+uint32_t alsa_buffer(struct alsa_s* alsa);
+
+int alsa_write(struct alsa_s* alsa, const int16_t* buffer, uint32_t frames);
+void alsa_drain(struct alsa_s* alsa);
+
+#endif // ALSA_H_INCLUDED
@@ -1,10 +1,17 @@
 #include "apu.h"
+#include "blip.h"
+#include "mix.h"
+#include "vrc6.h"
+#include "vrc7.h"
+#include "fds.h"
+#include "mmc5.h"
+#include "n163.h"
+#include "s5b.h"
 #include <malloc.h>
+#include <stddef.h>
 #include <string.h>
 
 
-extern M6502 cpu;
-
 #define APU_PULSE1DUTYVOL   0x4000
 #define APU_PULSE1SWEEP     0x4001
 #define APU_PULSE1TMRL      0x4002
@@ -26,37 +33,43 @@ extern M6502 cpu;
 #define APU_STATUS          0x4015
 #define APU_FRAMECNTR       0x4017
 
+// the channels use whole bytes and words rather than bitfields, so that
+// the timers apu_cycle() and apu_skip() count down are plain loads and
+// stores. each channel has what its timer touches first, then the state the
+// frame counter clocks, then what only register writes change. the value
+// ranges are kept by the code that sets the fields.
+
 struct apuenvelope_s
 {
-    byte loop_halt:1;
-    byte const_vol:1;
-    byte volperiod:4;
-    byte counter:4;
-    byte divider:5;
-    byte start:1;
-    byte out:4;
+    byte out;               // 0-15, the channel's volume
+    byte counter;           // 0-15
+    byte divider;           // 5 bits, wraps like the chip's
+    byte start;
+
+    byte volperiod;         // 0-15, also the constant volume
+    byte loop_halt;
+    byte const_vol;
 };
 struct apupulse_s
 {
-    byte duty:2;            // duty cycle of the pulse
-    struct apuenvelope_s env;
-
-    byte sweep_enable:1;
-    byte sweep_period:3;
-    byte sweep_negate:1;
-    byte sweep_shift:3;
-    byte sweep_divider:4;
-    word sweep_target:12;
-    byte sweep_silence:1;
-    byte sweep_reload:1;
+    word timer;             // counts down to the next phase step
+    word timer_period;      // 11 bits, controls the frequency of the pulse
+    byte phase;             // 0-7, pulse wave phase/sequence
+    byte duty;              // 0-3, duty cycle of the pulse
 
-    word timer_period:11;      // controls the frequency of the pulse
-    byte counter;            // length counter; when reaches zero, channel is silenced
+    byte counter;           // length counter; when reaches zero, channel is silenced
+    byte sweep_silence;
+    struct apuenvelope_s env;
 
-    word timer:12;             // set to timer_period * 8 (left shift) when timer period set, or this overflows
-    byte phase:3;              // pulse wave phase/sequence
+    word sweep_target;      // up to 12 bits, silences the pulse past $7FF
+    byte sweep_divider;     // 0-8
+    byte sweep_reload;
+    byte sweep_enable;
+    byte sweep_period;      // 0-7
+    byte sweep_negate;
+    byte sweep_shift;       // 0-7
 
-    byte enabled:1;
+    byte enabled;
 };
 
 const byte pulseseq[4][8] =
@@ -69,17 +82,17 @@ const byte pulseseq[4][8] =
 
 struct aputri_s
 {
-    byte control:1;
-    byte halt:1;
-    byte cnt_reload:7;          // linear counter reload value
+    word timer;                 // sequence timer
+    word timer_period;          // 11 bits, period for the wave frequency timer
+    byte phase;                 // 0-31, triangle wave phase/sequence
 
-    word timer_period:11;       // period for the wave frequency timer
-    byte counter;             // length counter
-    byte lincount:7;            // linear counter
-    word timer:11;              // sequence timer
-    byte phase:5;               // triangle wave phase/sequence
+    byte counter;               // length counter
+    byte lincount;              // 7 bit linear counter
+    byte halt;
 
-    byte enabled:1;
+    byte cnt_reload;            // 7 bit linear counter reload value
+    byte control;
+    byte enabled;
 };
 
 const byte triseq[32] =
@@ -92,16 +105,16 @@ const byte triseq[32] =
 
 struct apunoise_s
 {
-    struct apuenvelope_s env;
+    word timer;
+    word period_actual;         // in APU cycles, from the period tables
+    word shiftreg;              // 15 bit shift reg for noise
+    byte mode;
 
-    byte mode:1;
-    byte period:4;
-    word period_actual:12;
-    word timer:12;
     byte counter;
-    word shiftreg:15;           // shift reg for noise
+    struct apuenvelope_s env;
 
-    byte enabled:1;
+    byte period;                // 0-15
+    byte enabled;
 };
 
 const word noise_periods_ntsc[16] =
@@ -115,27 +128,27 @@ const word noise_periods_pal[16] =
 
 struct apudmc_s
 {
-    byte irq:1;
-    byte loop:1;
-    byte rate:4;
-    word rate_actual:9;
-    word timer:9;
-
-    // memory reader
-    word address;
-    word addresscur;
-    word length:12;
-    word bytesleft:12;
-    byte sample;
-    byte buffered:1;
+    word timer;
+    word rate_actual;           // in CPU cycles, from the period tables
 
     // output unit
-    byte counter:7;
+    byte counter;               // 7 bit output level
     byte shiftreg;
     byte bitsleft;
     byte silence;
 
-    byte control:1;
+    // memory reader
+    byte sample;
+    byte buffered;
+    byte control;
+    word addresscur;
+    word bytesleft;             // 12 bits
+
+    word address;
+    word length;                // 12 bits
+    byte rate;                  // 0-15
+    byte loop;
+    byte irq;
 };
 
 const word dmc_periods_ntsc[16] =
@@ -153,9 +166,71 @@ const byte length_lut[32] =
     12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
 };
 
+// the nonlinear mix of the 2A03 as 32 bit levels, indexed by pulse1+pulse2
+// and by 3*tri + 2*noise + dmc. both are constant expressions, so every
+// instance shares the same read-only tables without building them.
+#define APU_PULSE_MIX(n)    ((n) ? (uint32_t)((95.52 / (8128.0 / (double)(n) + 100.0)) * 0xFFFFFFFFUL) : 0)
+#define APU_TND_MIX(n)      ((n) ? (uint32_t)((163.67 / (24329.0 / (double)(n) + 100.0)) * 0xFFFFFFFFUL) : 0)
+
+#define APU_MIX10(f, n) \
+    f((n)+0), f((n)+1), f((n)+2), f((n)+3), f((n)+4), \
+    f((n)+5), f((n)+6), f((n)+7), f((n)+8), f((n)+9)
+#define APU_MIX100(f, n) \
+    APU_MIX10(f, (n)+0),  APU_MIX10(f, (n)+10), APU_MIX10(f, (n)+20), APU_MIX10(f, (n)+30), APU_MIX10(f, (n)+40), \
+    APU_MIX10(f, (n)+50), APU_MIX10(f, (n)+60), APU_MIX10(f, (n)+70), APU_MIX10(f, (n)+80), APU_MIX10(f, (n)+90)
+
+static const uint32_t pulse_mix_lut[31] =
+{
+    APU_MIX10(APU_PULSE_MIX, 0), APU_MIX10(APU_PULSE_MIX, 10), APU_MIX10(APU_PULSE_MIX, 20),
+    APU_PULSE_MIX(30)
+};
+
+static const uint32_t tnd_mix_lut[203] =
+{
+    APU_MIX100(APU_TND_MIX, 0), APU_MIX100(APU_TND_MIX, 100),
+    APU_TND_MIX(200), APU_TND_MIX(201), APU_TND_MIX(202)
+};
+
+// expansion chips, by their bit in the mapper mask of apu_reset()
+static const apumapper_t* const apu_mappertable[APU_MAPPERS] =
+{
+    &vrc6_mapper,   // APU_EXT_VRC6
+    &vrc7_mapper,   // APU_EXT_VRC7
+    &fds_mapper,    // APU_EXT_FDS
+    &mmc5_mapper,   // APU_EXT_MMC5
+    &n163_mapper,   // APU_EXT_N163
+    &s5b_mapper,    // APU_EXT_5B
+};
+
+static const char* const apu_mappernames[APU_MAPPERS] =
+{
+    "VRC6", "VRC7", "FDS", "MMC5", "Namco 163", "Sunsoft 5B"
+};
+
+#define APU_QUEUE 1024      // register writes that can wait for their cycle, to start with
+
+struct apuwrite_s
+{
+    uint64_t time;          // CPU cycle, counted from apu_reset()
+    word addr;
+    byte data;
+};
+
 struct apu_s
 {
-    byte regs[(APU_FRAMECNTR - APU_PULSE1DUTYVOL)+1];
+    // what every cycle touches: the sample clock, then the channels and the
+    // frame counter, the first 140 bytes of the instance. only the end of
+    // the DMC and the frame counter fall past the first 128.
+    uint64_t clock;         // CPU cycle the current output sample starts at
+    uint32_t cpu_cycles;
+    uint32_t elapsed;       // cycles of the current output sample already run
+
+    // apu_run() counts the cycles of a sample from 'phase', the parity of
+    // 'clock', so that the odd ones stay the APU cycles across samples
+    uint32_t phase;
+    int32_t level;          // last mixed level handed to the blip buffer
+    uint32_t blipclock;     // start of the current sample in the blip frame
+
     struct apupulse_s pulse1;
     struct apupulse_s pulse2;
     struct aputri_s   tri;
@@ -163,25 +238,65 @@ struct apu_s
     struct apudmc_s   dmc;
     struct apuframecnt_s
     {
-        byte mode:1;
-        byte interrupt:1;
-        byte int_inhibit:1;
-        byte updated:1;
-        word count:15;
+        word count;
+        byte updated;
+        byte mode;
+        byte interrupt;
+        byte int_inhibit;
     }framecnt;
 
-    uint32_t cpu_cycles;
-
+    // touched once per register write or less, mostly set up by apu_create()
+    byte regs[(APU_FRAMECNTR - APU_PULSE1DUTYVOL)+1];
     struct apuenvelope_s* envelopes[3];
     uint32_t cpu_clock;
 
     uint32_t clock_cycles_per_sample;   // fixed point 8 bit fractional
     const word* noise_periods;
     const word* dmc_periods;
-    uint32_t pulse_mix_lut[31];
-    uint32_t tnd_mix_lut[203];
 
-}*apuctx;
+    apumemread_t memread;       // DMC sample fetches
+    void* memparam;
+
+    struct blip_s* blip;        // set for APU_SYNTH_BLEP
+    int16_t blipsample;
+
+    int32_t gain;               // of apu_render(), MIX_UNITY is 1.0
+
+    // channel levels of each sample of the block apu_render() is working on,
+    // mixed in one pass once the block has been emulated
+    byte out_pulse1[APU_BLOCK];
+    byte out_pulse2[APU_BLOCK];
+    byte out_tri[APU_BLOCK];
+    byte out_noise[APU_BLOCK];
+    byte out_dmc[APU_BLOCK];
+    int16_t out_blip[APU_BLOCK];
+
+    // expansion chips created by apu_reset(), and their summed output for
+    // each sample of the block
+    const apumapper_t* mappers[APU_MAPPERS];
+    void* chips[APU_MAPPERS];
+    int nchips;
+    byte chipstems[APU_MAPPERS];    // apu_renderstems() tracks of each chip
+    int nchipstems;
+    int32_t out_ext[APU_BLOCK];
+    int options[APU_OPTIONS];   // handed to every chip apu_reset() creates
+
+    // set while apu_renderstems() runs, apu_runblock() then also keeps the
+    // levels with APU_SYNTH_BLEP and the output of each chip channel
+    byte stems;
+    int32_t out_chips[APU_STEMS_EXT][APU_BLOCK];
+
+    // writes timestamped past the current output sample, oldest first. the
+    // ring doubles when a play routine writes more than it holds.
+    struct apuwrite_s* queue;
+    uint32_t queue_size;    // a power of 2
+    uint32_t queue_head;
+    uint32_t queue_tail;
+
+#ifdef NSF_STATS
+    struct apustats_s stats;
+#endif
+};
 
 
 #define CPU_CLOCK_NTSC 1789773L // Hz
@@ -194,6 +309,14 @@ struct apu_s* apu_create(int samplerate, byte clockstandard)
 
     if(!apu) return NULL;
 
+    apu->queue_size = APU_QUEUE;
+    apu->queue = malloc(APU_QUEUE*sizeof(struct apuwrite_s));
+    if(!apu->queue)
+    {
+        free(apu);
+        return NULL;
+    }
+
     if(clockstandard == APU_NTSC)
     {
         apu->cpu_clock = CPU_CLOCK_NTSC;
@@ -216,222 +339,537 @@ struct apu_s* apu_create(int samplerate, byte clockstandard)
 
     apu->clock_cycles_per_sample = (uint32_t) ((((uint64_t)apu->cpu_clock)<<16) / samplerate);
 
-    int n;
-    for(n = 0; n < 31; ++n)
-    {
-        apu->pulse_mix_lut[n] = (uint32_t)((95.52 / (8128.0 / (double)n + 100.0)) * 0xFFFFFFFFUL);
-    }
-
-    for(n = 0; n < 203; ++n)
-    {
-        apu->tnd_mix_lut[n] = (uint32_t)((163.67 / (24329.0 / (double)n + 100.0)) * 0xFFFFFFFFUL);
-    }
-
     apu->envelopes[0] = &apu->pulse1.env;
     apu->envelopes[1] = &apu->pulse2.env;
     apu->envelopes[2] = &apu->noise.env;
 
+    apu->memread = NULL;
+    apu->memparam = NULL;
+
+    apu->blip = NULL;
+    apu->blipsample = 0;
+
+    apu->gain = MIX_UNITY;
+
+    apu->nchips = 0;
+    apu->nchipstems = 0;
+    apu->stems = 0;
+    memset(apu->options, 0, sizeof(apu->options));
+
     return apu;
 }
 
+static void apu_freechips(struct apu_s* apu)
+{
+    int i;
+
+    for(i = 0; i < apu->nchips; ++i)
+        apu->mappers[i]->cleanup(apu->chips[i]);
+
+    apu->nchips = 0;
+    apu->nchipstems = 0;
+}
+
 void apu_destroy(struct apu_s* apu)
 {
     if(apu == NULL)
-        apu = apuctx;
+        return;
 
-    if(apuctx == apu)
-        apuctx = NULL;
+    apu_freechips(apu);
 
+    blip_destroy(apu->blip);
+    free(apu->queue);
     free(apu);
 }
 
-void apu_setcontext(struct apu_s* apu)
+// APU_SYNTH_POINT samples the channels once per output sample.
+// APU_SYNTH_BLEP feeds every change of the mixed output through a band
+// limited step buffer instead, which costs a little more but does not alias.
+int apu_setsynthesis(struct apu_s* apu, byte mode)
 {
-    if(apu != NULL)
-        apuctx = apu;
+    if(mode == APU_SYNTH_BLEP)
+    {
+        if(!apu->blip)
+        {
+            // one frame per block of output samples, plus slack for rounding
+            apu->blip = blip_create(apu->clock_cycles_per_sample, APU_BLOCK+4);
+            if(!apu->blip)
+                return 0;
+        }
+    }
+    else
+    {
+        blip_destroy(apu->blip);
+        apu->blip = NULL;
+    }
+
+    return 1;
 }
 
-void apu_quarter_frame(void);
-void apu_half_frame(void);
+// volume of apu_render() and apu_renderf(), 1.0 leaves the mix as it is.
+// anything that ends up out of range is clipped.
+void apu_setgain(struct apu_s* apu, float gain)
+{
+    if(gain < 0.0f) gain = 0.0f;
+    if(gain > 16.0f) gain = 16.0f;
 
-void apu_calcsweep_pulse1(void)
+    apu->gain = (int32_t)(gain*MIX_UNITY + 0.5f);
+}
+
+// the CPU clock in Hz, NTSC or PAL
+uint32_t apu_cpuclock(struct apu_s* apu)
+{
+    return apu->cpu_clock;
+}
+
+#ifdef NSF_STATS
+// counts since the last apu_reset()
+void apu_stats(struct apu_s* apu, struct apustats_s* stats)
+{
+    *stats = apu->stats;
+}
+#endif
+
+void apu_setmemread(struct apu_s* apu, apumemread_t read, void* param)
 {
-    if(apuctx->pulse1.sweep_negate)
-        apuctx->pulse1.sweep_target = apuctx->pulse1.timer_period - ((apuctx->pulse1.timer_period>>apuctx->pulse1.sweep_shift)-1);
+    apu->memread = read;
+    apu->memparam = param;
+}
+
+void apu_quarter_frame(struct apu_s* apu);
+void apu_half_frame(struct apu_s* apu);
+
+void apu_calcsweep_pulse1(struct apu_s* apu)
+{
+    if(apu->pulse1.sweep_negate)
+        apu->pulse1.sweep_target = apu->pulse1.timer_period - ((apu->pulse1.timer_period>>apu->pulse1.sweep_shift)-1);
     else
-        apuctx->pulse1.sweep_target = apuctx->pulse1.timer_period + (apuctx->pulse1.timer_period>>apuctx->pulse1.sweep_shift);
+        apu->pulse1.sweep_target = apu->pulse1.timer_period + (apu->pulse1.timer_period>>apu->pulse1.sweep_shift);
 
-    if((apuctx->pulse1.timer_period < 8) || (apuctx->pulse1.sweep_target > 0x7FF))
-        apuctx->pulse1.sweep_silence = 1;
+    if((apu->pulse1.timer_period < 8) || (apu->pulse1.sweep_target > 0x7FF))
+        apu->pulse1.sweep_silence = 1;
     else
-        apuctx->pulse1.sweep_silence = 0;
+        apu->pulse1.sweep_silence = 0;
 }
 
-void apu_calcsweep_pulse2(void)
+void apu_calcsweep_pulse2(struct apu_s* apu)
 {
-    if(apuctx->pulse2.sweep_negate)
-        apuctx->pulse2.sweep_target = apuctx->pulse2.timer_period - (apuctx->pulse2.timer_period>>apuctx->pulse2.sweep_shift);
+    if(apu->pulse2.sweep_negate)
+        apu->pulse2.sweep_target = apu->pulse2.timer_period - (apu->pulse2.timer_period>>apu->pulse2.sweep_shift);
     else
-        apuctx->pulse2.sweep_target = apuctx->pulse2.timer_period + (apuctx->pulse2.timer_period>>apuctx->pulse2.sweep_shift);
+        apu->pulse2.sweep_target = apu->pulse2.timer_period + (apu->pulse2.timer_period>>apu->pulse2.sweep_shift);
 
-    if((apuctx->pulse2.timer_period < 8) || (apuctx->pulse2.sweep_target > 0x7FF))
-        apuctx->pulse2.sweep_silence = 1;
+    if((apu->pulse2.timer_period < 8) || (apu->pulse2.sweep_target > 0x7FF))
+        apu->pulse2.sweep_silence = 1;
     else
-        apuctx->pulse2.sweep_silence = 0;
+        apu->pulse2.sweep_silence = 0;
 }
 
-void apu_write(word addr, byte data)
+static void apu_run(struct apu_s* apu, uint32_t c, uint32_t end);
+static void apu_blipupdate(struct apu_s* apu, uint32_t time);
+
+// mask of the APU_EXT_* chips that are emulated
+byte apu_mappers(void)
 {
+    byte mask = 0;
+    int i;
+
+    for(i = 0; i < APU_MAPPERS; ++i)
+    {
+        if(apu_mappertable[i])
+            mask |= 1<<i;
+    }
+
+    return mask;
+}
+
+// name of the chip with bit 'bit' in the mapper mask, 0 based
+const char* apu_mappername(int bit)
+{
+    if(bit < 0 || bit >= APU_MAPPERS)
+        return "unknown";
+
+    return apu_mappernames[bit];
+}
+
+// an APU_OPT_* setting of the expansion chips, kept for the chips of later
+// apu_reset() calls as well
+void apu_setoption(struct apu_s* apu, int option, int value)
+{
+    int i;
+
+    if(option < 0 || option >= APU_OPTIONS)
+        return;
+
+    apu->options[option] = value;
+
+    for(i = 0; i < apu->nchips; ++i)
+    {
+        if(apu->mappers[i]->option)
+            apu->mappers[i]->option(apu->chips[i], option, value);
+    }
+}
+
+// run the expansion chips for 'cycles' CPU cycles
+static void apu_runchips(struct apu_s* apu, uint32_t cycles)
+{
+    int i;
+
+    for(i = 0; i < apu->nchips; ++i)
+        apu->mappers[i]->process(apu->chips[i], cycles);
+}
+
+static int32_t apu_chipoutput(struct apu_s* apu)
+{
+    int64_t sum = 0;
+    int i;
+
+    for(i = 0; i < apu->nchips; ++i)
+        sum += apu->mappers[i]->output(apu->chips[i]);
+
+    if(sum > INT32_MAX) return INT32_MAX;
+    if(sum < INT32_MIN) return INT32_MIN;
+    return (int32_t)sum;
+}
+
+// apu_chipoutput(), keeping the level of each chip channel in
+// out_chips[][i] as well. chips without channels keep their output.
+static int32_t apu_chipstems(struct apu_s* apu, int i)
+{
+    int32_t levels[APU_STEMS_EXT];
+    int32_t out;
+    int64_t sum = 0;
+    int c, j, stem = 0;
+
+    for(c = 0; c < apu->nchips; ++c)
+    {
+        out = apu->mappers[c]->output(apu->chips[c]);
+        sum += out;
+
+        if(apu->mappers[c]->stems)
+        {
+            apu->mappers[c]->stems(apu->chips[c], levels);
+            for(j = 0; j < apu->chipstems[c]; ++j)
+                apu->out_chips[stem+j][i] = levels[j];
+        }
+        else
+            apu->out_chips[stem][i] = out;
+
+        stem += apu->chipstems[c];
+    }
+
+    if(sum > INT32_MAX) return INT32_MAX;
+    if(sum < INT32_MIN) return INT32_MIN;
+    return (int32_t)sum;
+}
+
+// run everything up to cycle 'time' of the current output sample
+static inline void apu_catchup(struct apu_s* apu, uint32_t time)
+{
+    if(time > apu->elapsed)
+    {
+        apu_run(apu, apu->elapsed, time);
+        if(apu->nchips)
+            apu_runchips(apu, time - apu->elapsed);
+        apu->elapsed = time;
+    }
+}
+
+// CPU cycle 'time' as counted by apu_run() in the current output sample.
+// anything before the sample lands on its first cycle.
+static inline uint32_t apu_sampletime(struct apu_s* apu, uint64_t time)
+{
+    if(time <= apu->clock)
+        return apu->phase;
+
+    return apu->phase + (uint32_t)(time - apu->clock);
+}
+
+// the register write itself, at cycle 'time' of the current output sample.
+// the APU is caught up to that point before the register changes.
+static void apu_writereg(struct apu_s* apu, uint32_t time, word addr, byte data)
+{
+    int i;
+
+    apu_catchup(apu, time);
+
+    STAT(if(addr >= APU_PULSE1DUTYVOL && addr <= APU_FRAMECNTR) ++apu->stats.writes[addr-APU_PULSE1DUTYVOL];)
+
     switch(addr)
     {
         // basic APU registers
         case APU_PULSE1DUTYVOL:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->pulse1.duty             = data>>6;
-            apuctx->pulse1.env.loop_halt    = BIT(data, 5);//data&0x20;
-            apuctx->pulse1.env.const_vol    = BIT(data, 4);//data&0x10;
-            apuctx->pulse1.env.volperiod    = data&0xF;
+            apu->regs[addr&0x1F] = data;
+            apu->pulse1.duty             = data>>6;
+            apu->pulse1.env.loop_halt    = BIT(data, 5);//data&0x20;
+            apu->pulse1.env.const_vol    = BIT(data, 4);//data&0x10;
+            apu->pulse1.env.volperiod    = data&0xF;
             break;
         case APU_PULSE1SWEEP:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->pulse1.sweep_enable = BIT(data, 7);//data&0x80;
-            apuctx->pulse1.sweep_period = (data>>4)&0x07;
-            apuctx->pulse1.sweep_negate = BIT(data, 3);//data&0x08;
-            apuctx->pulse1.sweep_shift = data&0x07;
-            apuctx->pulse1.sweep_reload = 1;
+            apu->regs[addr&0x1F] = data;
+            apu->pulse1.sweep_enable = BIT(data, 7);//data&0x80;
+            apu->pulse1.sweep_period = (data>>4)&0x07;
+            apu->pulse1.sweep_negate = BIT(data, 3);//data&0x08;
+            apu->pulse1.sweep_shift = data&0x07;
+            apu->pulse1.sweep_reload = 1;
             break;
         case APU_PULSE1TMRL:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->pulse1.timer_period = (apuctx->pulse1.timer_period&0x0700)|data;
-            apu_calcsweep_pulse1();
+            apu->regs[addr&0x1F] = data;
+            apu->pulse1.timer_period = (apu->pulse1.timer_period&0x0700)|data;
+            apu_calcsweep_pulse1(apu);
             break;
         case APU_PULSE1TMRH:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->pulse1.timer_period = (apuctx->pulse1.timer_period&0x00FF)|((data&0x07)<<8);
-            apu_calcsweep_pulse1();
-            if(apuctx->pulse1.enabled) apuctx->pulse1.counter = length_lut[data>>3];
-            apuctx->pulse1.phase = 0;       // reset phase/sequence
-            apuctx->pulse1.env.start = 1;
+            apu->regs[addr&0x1F] = data;
+            apu->pulse1.timer_period = (apu->pulse1.timer_period&0x00FF)|((data&0x07)<<8);
+            apu_calcsweep_pulse1(apu);
+            if(apu->pulse1.enabled) apu->pulse1.counter = length_lut[data>>3];
+            apu->pulse1.phase = 0;       // reset phase/sequence
+            apu->pulse1.env.start = 1;
             break;
         case APU_PULSE2DUTYVOL:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->pulse2.duty             = data>>6;
-            apuctx->pulse2.env.loop_halt    = BIT(data, 5);//data&0x20;
-            apuctx->pulse2.env.const_vol    = BIT(data, 4);//data&0x10;
-            apuctx->pulse2.env.volperiod    = data&0xF;
+            apu->regs[addr&0x1F] = data;
+            apu->pulse2.duty             = data>>6;
+            apu->pulse2.env.loop_halt    = BIT(data, 5);//data&0x20;
+            apu->pulse2.env.const_vol    = BIT(data, 4);//data&0x10;
+            apu->pulse2.env.volperiod    = data&0xF;
             break;
         case APU_PULSE2SWEEP:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->pulse2.sweep_enable = BIT(data, 7);//data&0x80;
-            apuctx->pulse2.sweep_period = (data>>4)&0x07;
-            apuctx->pulse2.sweep_negate = BIT(data, 3);//data&0x08;
-            apuctx->pulse2.sweep_shift = data&0x07;
-            apuctx->pulse2.sweep_reload = 1;
+            apu->regs[addr&0x1F] = data;
+            apu->pulse2.sweep_enable = BIT(data, 7);//data&0x80;
+            apu->pulse2.sweep_period = (data>>4)&0x07;
+            apu->pulse2.sweep_negate = BIT(data, 3);//data&0x08;
+            apu->pulse2.sweep_shift = data&0x07;
+            apu->pulse2.sweep_reload = 1;
             break;
         case APU_PULSE2TMRL:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->pulse2.timer_period = (apuctx->pulse2.timer_period&0x0700)|data;
-            apu_calcsweep_pulse2();
+            apu->regs[addr&0x1F] = data;
+            apu->pulse2.timer_period = (apu->pulse2.timer_period&0x0700)|data;
+            apu_calcsweep_pulse2(apu);
             break;
         case APU_PULSE2TMRH:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->pulse2.timer_period = (apuctx->pulse2.timer_period&0x00FF)|((data&0x07)<<8);
-            apu_calcsweep_pulse2();
-            if(apuctx->pulse2.enabled) apuctx->pulse2.counter = length_lut[data>>3];
-            apuctx->pulse2.phase = 0;       // reset phase/sequence
-            apuctx->pulse2.env.start = 1;
+            apu->regs[addr&0x1F] = data;
+            apu->pulse2.timer_period = (apu->pulse2.timer_period&0x00FF)|((data&0x07)<<8);
+            apu_calcsweep_pulse2(apu);
+            if(apu->pulse2.enabled) apu->pulse2.counter = length_lut[data>>3];
+            apu->pulse2.phase = 0;       // reset phase/sequence
+            apu->pulse2.env.start = 1;
             break;
         case APU_TRICOUNTER:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->tri.control = BIT(data, 7);//data&0x80;
-            if(apuctx->tri.control)
-                apuctx->tri.halt = 1;
-            apuctx->tri.cnt_reload = data&0x7f;
+            apu->regs[addr&0x1F] = data;
+            apu->tri.control = BIT(data, 7);//data&0x80;
+            if(apu->tri.control)
+                apu->tri.halt = 1;
+            apu->tri.cnt_reload = data&0x7f;
             break;
         case APU_TRITMRL:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->tri.timer_period = (apuctx->tri.timer_period&0x0700)|data;
+            apu->regs[addr&0x1F] = data;
+            apu->tri.timer_period = (apu->tri.timer_period&0x0700)|data;
             break;
         case APU_TRITMRH:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->tri.timer_period = (apuctx->tri.timer_period&0x00FF)|((data&0x07)<<8);
-            if(apuctx->tri.enabled) apuctx->tri.counter = length_lut[data>>3];
-            apuctx->tri.halt = 1;    // set halt flag
+            apu->regs[addr&0x1F] = data;
+            apu->tri.timer_period = (apu->tri.timer_period&0x00FF)|((data&0x07)<<8);
+            if(apu->tri.enabled) apu->tri.counter = length_lut[data>>3];
+            apu->tri.halt = 1;    // set halt flag
             break;
         case APU_NOISEVOL:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->noise.env.loop_halt = BIT(data, 5);//data&0x20;
-            apuctx->noise.env.const_vol = BIT(data, 4);//data&0x10;
-            apuctx->noise.env.volperiod = data&0x0F;
+            apu->regs[addr&0x1F] = data;
+            apu->noise.env.loop_halt = BIT(data, 5);//data&0x20;
+            apu->noise.env.const_vol = BIT(data, 4);//data&0x10;
+            apu->noise.env.volperiod = data&0x0F;
             break;
         case APU_NOISEPERIOD:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->noise.mode = BIT(data, 7);//data&0x80;
-            apuctx->noise.period = data&0x0F;
-            apuctx->noise.period_actual = apuctx->noise_periods[apuctx->noise.period];
+            apu->regs[addr&0x1F] = data;
+            apu->noise.mode = BIT(data, 7);//data&0x80;
+            apu->noise.period = data&0x0F;
+            apu->noise.period_actual = apu->noise_periods[apu->noise.period];
             break;
         case APU_NOISELCL:
-            apuctx->regs[addr&0x1F] = data;
-            if(apuctx->noise.enabled) apuctx->noise.counter = length_lut[data>>3];
-            apuctx->noise.env.start = 1;
+            apu->regs[addr&0x1F] = data;
+            if(apu->noise.enabled) apu->noise.counter = length_lut[data>>3];
+            apu->noise.env.start = 1;
             break;
         case APU_DMCIRQ:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->dmc.irq = BIT(data, 7);//data&0x80;
-            apuctx->dmc.loop = BIT(data, 6);//data&0x40;
-            apuctx->dmc.rate = data&0x0f;
-            apuctx->dmc.rate_actual = apuctx->dmc_periods[apuctx->dmc.rate];
+            apu->regs[addr&0x1F] = data;
+            apu->dmc.irq = BIT(data, 7);//data&0x80;
+            apu->dmc.loop = BIT(data, 6);//data&0x40;
+            apu->dmc.rate = data&0x0f;
+            apu->dmc.rate_actual = apu->dmc_periods[apu->dmc.rate];
             break;
         case APU_DMCCOUNTER:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->dmc.counter = data&0x7f;
+            apu->regs[addr&0x1F] = data;
+            apu->dmc.counter = data&0x7f;
             break;
         case APU_DMCADDR:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->dmc.address = (data<<6) | 0xC000;
-            apuctx->dmc.addresscur = apuctx->dmc.address;
+            apu->regs[addr&0x1F] = data;
+            apu->dmc.address = (data<<6) | 0xC000;
+            apu->dmc.addresscur = apu->dmc.address;
             break;
         case APU_DMCLENGTH:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->dmc.length = (data<<4) | 1;
-            apuctx->dmc.bytesleft = apuctx->dmc.length;
+            apu->regs[addr&0x1F] = data;
+            apu->dmc.length = (data<<4) | 1;
+            apu->dmc.bytesleft = apu->dmc.length;
             break;
         case APU_STATUS:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->dmc.control = BIT(data, 4);//(data>>4)&1;
-            apuctx->noise.enabled = BIT(data, 3);//data&0x08;
-            apuctx->tri.enabled =   BIT(data, 2);//data&0x04;
-            apuctx->pulse2.enabled = BIT(data, 1);//(data>>1)&1;
-            apuctx->pulse1.enabled = BIT(data, 0);//data&1;
+            apu->regs[addr&0x1F] = data;
+            apu->dmc.control = BIT(data, 4);//(data>>4)&1;
+            apu->noise.enabled = BIT(data, 3);//data&0x08;
+            apu->tri.enabled =   BIT(data, 2);//data&0x04;
+            apu->pulse2.enabled = BIT(data, 1);//(data>>1)&1;
+            apu->pulse1.enabled = BIT(data, 0);//data&1;
             break;
         case APU_FRAMECNTR:
-            apuctx->regs[addr&0x1F] = data;
-            apuctx->framecnt.count = 0;
-            apuctx->framecnt.mode = BIT(data, 7);//data&0x80;
-            apuctx->framecnt.int_inhibit = BIT(data, 6);//data&0x40;
-            apuctx->framecnt.updated = 1;
+            apu->regs[addr&0x1F] = data;
+            apu->framecnt.count = 0;
+            apu->framecnt.mode = BIT(data, 7);//data&0x80;
+            apu->framecnt.int_inhibit = BIT(data, 6);//data&0x40;
+            apu->framecnt.updated = 1;
+            break;
+        default:
+            // the first chip that knows the address takes it
+            for(i = 0; i < apu->nchips; ++i)
+            {
+                if(apu->mappers[i]->write(apu->chips[i], addr, data))
+                    break;
+            }
+            break;
+    }
+
+    if(apu->blip)
+        apu_blipupdate(apu, time);
+}
+
+// double the write queue, which is full. the writes keep their indices.
+static int apu_growqueue(struct apu_s* apu)
+{
+    uint32_t size = 2*apu->queue_size;
+    struct apuwrite_s* queue = malloc(size*sizeof(struct apuwrite_s));
+    uint32_t i;
+
+    if(!queue)
+        return 0;
+
+    for(i = apu->queue_head; i != apu->queue_tail; ++i)
+        queue[i & (size-1)] = apu->queue[i & (apu->queue_size-1)];
+
+    free(apu->queue);
+    apu->queue = queue;
+    apu->queue_size = size;
+
+    return 1;
+}
+
+// 'time' is the CPU cycle, counted from apu_reset(), at which the write
+// happens. writes within the output sample being worked on take effect
+// right away, later ones wait in a queue until rendering gets to them.
+// writes from the past happen now.
+void apu_write(struct apu_s* apu, uint64_t time, word addr, byte data)
+{
+    uint32_t end = (apu->cpu_cycles + apu->clock_cycles_per_sample)>>16;
+    struct apuwrite_s* w;
+
+    if((apu->queue_head == apu->queue_tail) && (time < apu->clock + end))
+    {
+        apu_writereg(apu, apu_sampletime(apu, time), addr, data);
+        return;
+    }
+
+    if((apu->queue_tail - apu->queue_head == apu->queue_size) && !apu_growqueue(apu))
+    {
+        // out of memory, the oldest write happens early rather than not at all
+        w = &apu->queue[apu->queue_head++ & (apu->queue_size-1)];
+        apu_writereg(apu, apu->elapsed, w->addr, w->data);
+    }
+
+    w = &apu->queue[apu->queue_tail++ & (apu->queue_size-1)];
+    w->time = time;
+    w->addr = addr;
+    w->data = data;
+}
+
+// CPU cycle the next output sample starts at
+uint64_t apu_clock(struct apu_s* apu)
+{
+    return apu->clock;
+}
+
+// how many output samples can be rendered before the one CPU cycle 'time'
+// falls into
+uint32_t apu_samplesbefore(struct apu_s* apu, uint64_t time)
+{
+    uint64_t x;
+
+    if(time < apu->clock)
+        return 0;
+
+    // sample k ends at clock + ((cpu_cycles + (k+1)*clock_cycles_per_sample)>>16)
+    x = ((time - apu->clock + 1)<<16) - apu->cpu_cycles;
+    x = (x + apu->clock_cycles_per_sample - 1) / apu->clock_cycles_per_sample - 1;
+
+    return (x > 0xFFFFFFFFULL) ? 0xFFFFFFFFUL : (uint32_t)x;
+}
+
+// run the APU up to CPU cycle 'time' for a read, queued writes up to it
+// included. the current output sample is as far as it can go, writes from
+// later samples land on its last cycle, early but in order.
+static void apu_readsync(struct apu_s* apu, uint64_t time)
+{
+    uint32_t end = apu->phase + ((apu->cpu_cycles + apu->clock_cycles_per_sample)>>16);
+    struct apuwrite_s* w;
+    uint32_t t;
+
+    while(apu->queue_head != apu->queue_tail)
+    {
+        w = &apu->queue[apu->queue_head & (apu->queue_size-1)];
+        if(w->time > time)
             break;
+
+        t = apu_sampletime(apu, w->time);
+        apu_writereg(apu, (t < end) ? t : end, w->addr, w->data);
+        ++apu->queue_head;
     }
+
+    t = apu_sampletime(apu, time);
+    apu_catchup(apu, (t < end) ? t : end);
 }
 
-byte apu_read(word addr)
+// 'time' is the CPU cycle of the read, as for apu_write()
+byte apu_read(struct apu_s* apu, uint64_t time, word addr)
 {
+    int i, data;
+
     if(addr == APU_STATUS)
     {
-        return (apuctx->dmc.irq<<7) | (apuctx->framecnt.interrupt<<6) | ((apuctx->noise.counter>0)<<3) | ((apuctx->tri.counter>0)<<2) | ((apuctx->pulse2.counter>0)<<1) | (apuctx->pulse1.counter>0);
+        apu_readsync(apu, time);
+        return (apu->dmc.irq<<7) | (apu->framecnt.interrupt<<6) | ((apu->noise.counter>0)<<3) | ((apu->tri.counter>0)<<2) | ((apu->pulse2.counter>0)<<1) | (apu->pulse1.counter>0);
     }
+
+    // a chip that answers does so from state queued writes change, like the
+    // N163 sound RAM or the FDS envelope gains
+    for(i = 0; i < apu->nchips; ++i)
+    {
+        if(addr < apu->mappers[i]->readfirst || addr > apu->mappers[i]->readlast)
+            continue;
+
+        apu_readsync(apu, time);
+        data = apu->mappers[i]->read(apu->chips[i], addr);
+        if(data >= 0)
+            return data;
+    }
+
     return 0;
 }
 
-void apu_quarter_frame(void)
+void apu_quarter_frame(struct apu_s* apu)
 {
     // process envelopes (pulses and noise)
     struct apuenvelope_s* env;
     int i;
 
+    STAT(++apu->stats.quarter_frames;)
+
     for(i = 0; i < 3; ++i)
     {
-        env = apuctx->envelopes[i];
+        env = apu->envelopes[i];
 
         if(env->start)
         {
@@ -443,7 +881,8 @@ void apu_quarter_frame(void)
         else
         {
 
-            if(!(--env->divider))
+            env->divider = (env->divider - 1) & 0x1F;
+            if(!env->divider)
             {
                 env->divider = env->volperiod+1;
 
@@ -464,355 +903,836 @@ void apu_quarter_frame(void)
     }
 
     // process triangle's linear counter
-    if(apuctx->tri.halt)
-        apuctx->tri.lincount = apuctx->tri.cnt_reload;
+    if(apu->tri.halt)
+        apu->tri.lincount = apu->tri.cnt_reload;
     else
-    if(apuctx->tri.lincount)
-        --apuctx->tri.lincount;
+    if(apu->tri.lincount)
+        --apu->tri.lincount;
 
-    if(!apuctx->tri.control)
-        apuctx->tri.halt = 0;
+    if(!apu->tri.control)
+        apu->tri.halt = 0;
 }
 
-void apu_half_frame(void)
+void apu_half_frame(struct apu_s* apu)
 {
+    STAT(++apu->stats.half_frames;)
+
     // process length counters of pulses, triangle, noise, and DMC
-    if(apuctx->pulse1.enabled)
+    if(apu->pulse1.enabled)
     {
-        if(apuctx->pulse1.counter && (!apuctx->pulse1.env.loop_halt))
+        if(apu->pulse1.counter && (!apu->pulse1.env.loop_halt))
         {
-            --apuctx->pulse1.counter;
+            --apu->pulse1.counter;
         }
     }
     else
     {
-        apuctx->pulse1.counter = 0;
+        apu->pulse1.counter = 0;
     }
 
-    if(apuctx->pulse2.enabled)
+    if(apu->pulse2.enabled)
     {
-        if(apuctx->pulse2.counter && (!apuctx->pulse2.env.loop_halt))
+        if(apu->pulse2.counter && (!apu->pulse2.env.loop_halt))
         {
-            --apuctx->pulse2.counter;
+            --apu->pulse2.counter;
         }
     }
     else
     {
-        apuctx->pulse2.counter = 0;
+        apu->pulse2.counter = 0;
     }
 
-    if(apuctx->tri.enabled)
+    if(apu->tri.enabled)
     {
-        if(apuctx->tri.counter && (!apuctx->tri.halt))
+        if(apu->tri.counter && (!apu->tri.halt))
         {
-            --apuctx->tri.counter;
+            --apu->tri.counter;
         }
     }
     else
     {
-        apuctx->tri.counter = 0;
+        apu->tri.counter = 0;
     }
 
-    if(apuctx->noise.enabled)
+    if(apu->noise.enabled)
     {
-        if(apuctx->noise.counter && (!apuctx->noise.env.loop_halt))
+        if(apu->noise.counter && (!apu->noise.env.loop_halt))
         {
-            --apuctx->noise.counter;
+            --apu->noise.counter;
         }
     }
     else
     {
-        apuctx->noise.counter = 0;
+        apu->noise.counter = 0;
     }
 
-    if(apuctx->pulse1.sweep_divider)
+    if(apu->pulse1.sweep_divider)
     {
         // sweep units
-        --apuctx->pulse1.sweep_divider;
-        if(apuctx->pulse1.sweep_reload)
+        --apu->pulse1.sweep_divider;
+        if(apu->pulse1.sweep_reload)
         {
-            apuctx->pulse1.sweep_reload = 0;
-            apuctx->pulse1.sweep_divider = apuctx->pulse1.sweep_period+1;
+            apu->pulse1.sweep_reload = 0;
+            apu->pulse1.sweep_divider = apu->pulse1.sweep_period+1;
         }
     }
     else
     {
-        if(apuctx->pulse1.sweep_enable && apuctx->pulse1.sweep_shift)
+        if(apu->pulse1.sweep_enable && apu->pulse1.sweep_shift)
         {
-     //   apuctx->pulse1.sweep_reload = 0;
-            apuctx->pulse1.sweep_divider = apuctx->pulse1.sweep_period+1;
+     //   apu->pulse1.sweep_reload = 0;
+            apu->pulse1.sweep_divider = apu->pulse1.sweep_period+1;
 
-            apuctx->pulse1.timer_period = apuctx->pulse1.sweep_target;
-            apu_calcsweep_pulse1();
+            apu->pulse1.timer_period = apu->pulse1.sweep_target & 0x7FF;
+            apu_calcsweep_pulse1(apu);
         }
     }
 
-    if(apuctx->pulse2.sweep_divider)
+    if(apu->pulse2.sweep_divider)
     {
         // sweep units
-        --apuctx->pulse2.sweep_divider;
-        if(apuctx->pulse2.sweep_reload)
+        --apu->pulse2.sweep_divider;
+        if(apu->pulse2.sweep_reload)
         {
-            apuctx->pulse2.sweep_reload = 0;
-            apuctx->pulse2.sweep_divider = apuctx->pulse2.sweep_period+1;
+            apu->pulse2.sweep_reload = 0;
+            apu->pulse2.sweep_divider = apu->pulse2.sweep_period+1;
         }
     }
     else
     {
-        if(apuctx->pulse2.sweep_enable && apuctx->pulse2.sweep_shift)
+        if(apu->pulse2.sweep_enable && apu->pulse2.sweep_shift)
         {
-          //  apuctx->pulse2.sweep_reload = 0;
-            apuctx->pulse2.sweep_divider = apuctx->pulse2.sweep_period+1;
+          //  apu->pulse2.sweep_reload = 0;
+            apu->pulse2.sweep_divider = apu->pulse2.sweep_period+1;
 
-            apuctx->pulse2.timer_period = apuctx->pulse2.sweep_target;
-            apu_calcsweep_pulse2();
+            apu->pulse2.timer_period = apu->pulse2.sweep_target & 0x7FF;
+            apu_calcsweep_pulse2(apu);
         }
     }
 }
 
-inline void apu_noisegen(void)
+inline void apu_noisegen(struct apu_s* apu)
 {
-    word feedback = (apuctx->noise.mode) ? ((apuctx->noise.shiftreg&1)^((apuctx->noise.shiftreg>>5)&1)) : ((apuctx->noise.shiftreg&1)^((apuctx->noise.shiftreg>>1)&1))<<14;
+    word feedback = (apu->noise.mode) ? ((apu->noise.shiftreg&1)^((apu->noise.shiftreg>>5)&1)) : ((apu->noise.shiftreg&1)^((apu->noise.shiftreg>>1)&1))<<14;
 
-    apuctx->noise.shiftreg = (apuctx->noise.shiftreg>>1) | feedback;
+    apu->noise.shiftreg = (apu->noise.shiftreg>>1) | feedback;
 }
 
-void apu_process(uint32_t cpu_cycles)
+// one CPU cycle of the APU. 'c' counts the cycles of the current output
+// sample, the odd ones are APU cycles.
+static void apu_cycle(struct apu_s* apu, uint32_t c)
 {
-    uint32_t c;
-
-    for(c = 0; c < cpu_cycles; ++c)
+    if((c&1) || apu->framecnt.updated)
     {
-        if((c&1) || apuctx->framecnt.updated)
+        // clock frame counter
+        if(apu->framecnt.mode)
         {
-            // clock frame counter
-            if(apuctx->framecnt.mode)
+            // 5 step sequence
+            if(apu->framecnt.updated||(apu->framecnt.count == 7456)||(apu->framecnt.count == 18640))
             {
-                // 5 step sequence
-                if(apuctx->framecnt.updated||(apuctx->framecnt.count == 7456)||(apuctx->framecnt.count == 18640))
+                // "quarter frame" and "half frame"
+                apu_quarter_frame(apu);
+                apu_half_frame(apu);
+                if(apu->framecnt.updated)
                 {
-                    // "quarter frame" and "half frame"
-                    apu_quarter_frame();
-                    apu_half_frame();
-                    if(apuctx->framecnt.updated)
-                    {
-                        apuctx->framecnt.updated = 0;
-                    }
+                    apu->framecnt.updated = 0;
                 }
-                else
-                if((apuctx->framecnt.count == 3728)||(apuctx->framecnt.count == 11185))
-                {
-                    // "quarter frame"
-                    apu_quarter_frame();
-                }
-
-                if(apuctx->framecnt.count == 18640)
-                    apuctx->framecnt.count = 0;
-                else
-                    ++apuctx->framecnt.count;
             }
             else
+            if((apu->framecnt.count == 3728)||(apu->framecnt.count == 11185))
             {
-                // 4 step sequence
-                if(apuctx->framecnt.updated||(apuctx->framecnt.count == 7456)||(apuctx->framecnt.count == 14914))
-                {
-                    // "quarter frame" and "half frame"
-                    apu_quarter_frame();
-                    apu_half_frame();
-                    if(apuctx->framecnt.updated)
-                    {
-                        apuctx->framecnt.updated = 0;
-                    }
-                }
-                else
-                if((apuctx->framecnt.count == 3728)||(apuctx->framecnt.count == 11185))
-                {
-                    // "quarter frame"
-                    apu_quarter_frame();
-                }
-
-                if(apuctx->framecnt.count == 14914)
-                {
-                    apuctx->framecnt.count = 0;
-                    if(!apuctx->framecnt.int_inhibit)
-                    {
-                        apuctx->framecnt.interrupt = 1;
-                      //  Int6502(&cpu, INT_IRQ);
-                      //  Run6502(&cpu);
-                    }
-                }
-                else
-                    ++apuctx->framecnt.count;
+                // "quarter frame"
+                apu_quarter_frame(apu);
             }
-        }
 
-        if(c&1)
-        {
-            // process timers for all waves
-            if(apuctx->pulse1.timer)
-                --apuctx->pulse1.timer;
+            if(apu->framecnt.count == 18640)
+                apu->framecnt.count = 0;
             else
+                ++apu->framecnt.count;
+        }
+        else
+        {
+            // 4 step sequence
+            if(apu->framecnt.updated||(apu->framecnt.count == 7456)||(apu->framecnt.count == 14914))
             {
-                apuctx->pulse1.timer = apuctx->pulse1.timer_period;
-                if(apuctx->pulse1.phase)
-                    --apuctx->pulse1.phase;
-                else
-                    apuctx->pulse1.phase = 7;
+                // "quarter frame" and "half frame"
+                apu_quarter_frame(apu);
+                apu_half_frame(apu);
+                if(apu->framecnt.updated)
+                {
+                    apu->framecnt.updated = 0;
+                }
             }
-
-            if(apuctx->pulse2.timer)
-                --apuctx->pulse2.timer;
             else
+            if((apu->framecnt.count == 3728)||(apu->framecnt.count == 11185))
             {
-                apuctx->pulse2.timer = apuctx->pulse2.timer_period;
-                if(apuctx->pulse2.phase)
-                    --apuctx->pulse2.phase;
-                else
-                    apuctx->pulse2.phase = 7;
+                // "quarter frame"
+                apu_quarter_frame(apu);
             }
 
-            if(apuctx->noise.timer)
-                --apuctx->noise.timer;
-            else
+            if(apu->framecnt.count == 14914)
             {
-                apuctx->noise.timer = apuctx->noise.period_actual;
-                // calculate noise
-                apu_noisegen();
+                apu->framecnt.count = 0;
+                if(!apu->framecnt.int_inhibit)
+                {
+                    apu->framecnt.interrupt = 1;
+                  //  Int6502(&cpu, INT_IRQ);
+                  //  Run6502(&cpu);
+                }
             }
+            else
+                ++apu->framecnt.count;
         }
+    }
 
-        // DMC shite
-        if(apuctx->dmc.control)
+    if(c&1)
+    {
+        // process timers for all waves
+        if(apu->pulse1.timer)
+            --apu->pulse1.timer;
+        else
         {
-            if(!apuctx->dmc.buffered && apuctx->dmc.bytesleft)
-            {
-                apuctx->dmc.sample = Rd6502(apuctx->dmc.addresscur);
-
-                if(!(--apuctx->dmc.bytesleft))
-                {
-                    if(apuctx->dmc.loop)
-                    {
-                        apuctx->dmc.addresscur = apuctx->dmc.address;
-                        apuctx->dmc.bytesleft = apuctx->dmc.length;
-                    }
-                    else
-                        apuctx->dmc.irq = 1;
-                }
-                else
-                if(apuctx->dmc.addresscur == 0xFFFF)
-                    apuctx->dmc.addresscur = 0x8000;
-                else
-                ++apuctx->dmc.addresscur;
-
-                apuctx->dmc.buffered = 1;
-            }
+            apu->pulse1.timer = apu->pulse1.timer_period;
+            if(apu->pulse1.phase)
+                --apu->pulse1.phase;
+            else
+                apu->pulse1.phase = 7;
         }
 
+        if(apu->pulse2.timer)
+            --apu->pulse2.timer;
+        else
+        {
+            apu->pulse2.timer = apu->pulse2.timer_period;
+            if(apu->pulse2.phase)
+                --apu->pulse2.phase;
+            else
+                apu->pulse2.phase = 7;
+        }
 
-        if(apuctx->dmc.timer)
-            --apuctx->dmc.timer;
+        if(apu->noise.timer)
+            --apu->noise.timer;
         else
         {
-            apuctx->dmc.timer = apuctx->dmc.rate_actual;
+            apu->noise.timer = apu->noise.period_actual;
+            // calculate noise
+            apu_noisegen(apu);
+        }
+    }
 
-            if(!apuctx->dmc.bitsleft)
+    // DMC shite
+    if(apu->dmc.control)
+    {
+        if(!apu->dmc.buffered && apu->dmc.bytesleft)
+        {
+            apu->dmc.sample = apu->memread ? apu->memread(apu->memparam, apu->dmc.addresscur) : 0;
+            STAT(++apu->stats.dmc_fetches;)
+
+            if(!(--apu->dmc.bytesleft))
             {
-                apuctx->dmc.bitsleft = 8;
-                if(!apuctx->dmc.buffered)
-                    apuctx->dmc.silence = 1;
-                else
+                if(apu->dmc.loop)
                 {
-                    apuctx->dmc.silence = 0;
-                    apuctx->dmc.shiftreg = apuctx->dmc.sample;
-                    apuctx->dmc.buffered = 0;
+                    apu->dmc.addresscur = apu->dmc.address;
+                    apu->dmc.bytesleft = apu->dmc.length;
                 }
-            }
-
-            if(!apuctx->dmc.silence)
-            {
-                if((apuctx->dmc.counter>1) && !(apuctx->dmc.shiftreg&1))
-                    apuctx->dmc.counter-=2;
                 else
-                if((apuctx->dmc.counter<126) && (apuctx->dmc.shiftreg&1))
-                    apuctx->dmc.counter+=2;
+                    apu->dmc.irq = 1;
             }
+            else
+            if(apu->dmc.addresscur == 0xFFFF)
+                apu->dmc.addresscur = 0x8000;
+            else
+            ++apu->dmc.addresscur;
 
-            apuctx->dmc.shiftreg>>=1;
-            --apuctx->dmc.bitsleft;
+            apu->dmc.buffered = 1;
         }
+    }
 
-        // clocked on every cycle
-        if((apuctx->tri.lincount>0) && (apuctx->tri.counter>0))
+
+    if(apu->dmc.timer)
+        --apu->dmc.timer;
+    else
+    {
+        apu->dmc.timer = apu->dmc.rate_actual;
+
+        if(!apu->dmc.bitsleft)
         {
-            if(apuctx->tri.timer)
-                --apuctx->tri.timer;
+            apu->dmc.bitsleft = 8;
+            if(!apu->dmc.buffered)
+                apu->dmc.silence = 1;
             else
             {
-                apuctx->tri.timer = apuctx->tri.timer_period;
-                if(apuctx->tri.phase)
-                    --apuctx->tri.phase;
-                else
-                    apuctx->tri.phase = 31;
+                apu->dmc.silence = 0;
+                apu->dmc.shiftreg = apu->dmc.sample;
+                apu->dmc.buffered = 0;
             }
         }
+
+        if(!apu->dmc.silence)
+        {
+            if((apu->dmc.counter>1) && !(apu->dmc.shiftreg&1))
+                apu->dmc.counter-=2;
+            else
+            if((apu->dmc.counter<126) && (apu->dmc.shiftreg&1))
+                apu->dmc.counter+=2;
+        }
+
+        apu->dmc.shiftreg>>=1;
+        --apu->dmc.bitsleft;
+    }
+
+    // clocked on every cycle
+    if((apu->tri.lincount>0) && (apu->tri.counter>0))
+    {
+        if(apu->tri.timer)
+            --apu->tri.timer;
+        else
+        {
+            apu->tri.timer = apu->tri.timer_period;
+            if(apu->tri.phase)
+                --apu->tri.phase;
+            else
+                apu->tri.phase = 31;
+        }
     }
 }
 
-int32_t apu_output(void)
+static const word framecnt_steps4[4] = { 3728, 7456, 11185, 14914 };
+static const word framecnt_steps5[4] = { 3728, 7456, 11185, 18640 };
+
+// first cycle at or after 'c' on which apu_cycle() has more to do than
+// count down timers, or 'end' if there is none before it
+static uint32_t apu_nextevent(struct apu_s* apu, uint32_t c, uint32_t end)
 {
-    if(!apuctx) return 0;
+    const word* steps = apu->framecnt.mode ? framecnt_steps5 : framecnt_steps4;
+    uint32_t next = end;
+    uint32_t odd = c|1;     // first APU cycle
+    uint32_t e;
+    int i;
+
+    if(apu->framecnt.updated)
+        return c;
+
+    // DMC memory reader refills its buffer right away
+    if(apu->dmc.control && !apu->dmc.buffered && apu->dmc.bytesleft)
+        return c;
+
+    // frame counter steps
+    e = odd;
+    for(i = 0; i < 4; ++i)
+    {
+        if(apu->framecnt.count <= steps[i])
+        {
+            e = odd + 2*(steps[i] - apu->framecnt.count);
+            break;
+        }
+    }
+    if(e < next) next = e;
 
-    apuctx->cpu_cycles += apuctx->clock_cycles_per_sample;
+    // timer reloads, clocked on APU cycles
+    e = odd + 2*apu->pulse1.timer;
+    if(e < next) next = e;
+    e = odd + 2*apu->pulse2.timer;
+    if(e < next) next = e;
+    e = odd + 2*apu->noise.timer;
+    if(e < next) next = e;
 
-    apu_process(apuctx->cpu_cycles>>16);
-    apuctx->cpu_cycles &= 0xFFFF;
+    // and on every CPU cycle
+    e = c + apu->dmc.timer;
+    if(e < next) next = e;
 
+    if((apu->tri.lincount>0) && (apu->tri.counter>0))
+    {
+        e = c + apu->tri.timer;
+        if(e < next) next = e;
+    }
+
+    return next;
+}
+
+// cycles 'c' to 'end' (exclusive) only count timers down, no timer reaches
+// zero before 'end'
+static void apu_skip(struct apu_s* apu, uint32_t c, uint32_t end)
+{
+    uint32_t cycles = end - c;
+    uint32_t apucycles = (end>>1) - (c>>1);     // odd cycles in between
+
+    apu->framecnt.count += apucycles;
+    apu->pulse1.timer -= apucycles;
+    apu->pulse2.timer -= apucycles;
+    apu->noise.timer -= apucycles;
+
+    apu->dmc.timer -= cycles;
+
+    if((apu->tri.lincount>0) && (apu->tri.counter>0))
+        apu->tri.timer -= cycles;
+}
+
+// run the APU over cycles 'c' to 'end' of the current output sample, jumping
+// from one timer or frame counter edge to the next
+static void apu_run(struct apu_s* apu, uint32_t c, uint32_t end)
+{
+    uint32_t next;
+
+    while(c < end)
+    {
+        next = apu_nextevent(apu, c, end);
+
+        if(next > c)
+            apu_skip(apu, c, next);
+
+        if(next >= end)
+            break;
+
+        apu_cycle(apu, next);
+        if(apu->blip)
+            apu_blipupdate(apu, next);
+
+        c = next+1;
+    }
+}
+
+// current output level of every channel
+static inline void apu_levels(struct apu_s* apu, byte* pulse1, byte* pulse2, byte* tri, byte* noise, byte* dmc)
+{
+    if(!apu->pulse1.counter || apu->pulse1.sweep_silence)
+        *pulse1 = 0;
+    else
+    {
+        *pulse1 = pulseseq[apu->pulse1.duty][apu->pulse1.phase] * apu->pulse1.env.out * (apu->pulse1.counter>0);
+    }
+
+    if(!apu->pulse2.counter || apu->pulse2.sweep_silence)
+        *pulse2 = 0;
+    else
+    {
+        *pulse2 = pulseseq[apu->pulse2.duty][apu->pulse2.phase] * apu->pulse2.env.out * (apu->pulse2.counter>0);
+    }
+
+    if(apu->tri.timer_period < 2)
+        *tri = 7;
+    else
+        *tri = triseq[apu->tri.phase];
+
+    *noise = (apu->noise.shiftreg&1) * apu->noise.env.out * (apu->noise.counter>0);
+    *dmc = apu->dmc.counter;
+}
+
+// mix of the current channel levels
+static int32_t apu_mix(struct apu_s* apu)
+{
     byte pulse1, pulse2;
     byte tri;
     byte noise;
     byte dmc;
 
-    if(!apuctx->pulse1.counter || apuctx->pulse1.sweep_silence)
-        pulse1 = 0;
-    else
+    apu_levels(apu, &pulse1, &pulse2, &tri, &noise, &dmc);
+
+                                            // "tri + tri<<1" (tri + tri*2 == tri*3) + noise<<1 (noise*2) + dmc
+    return (int32_t)((int64_t)(pulse_mix_lut[pulse1 + pulse2] + tnd_mix_lut[(tri + (tri<<1)) + (noise<<1) + dmc]) - 0x7fffffffL);
+}
+
+// hand any change of the output at cycle 'time' of this sample to the
+// blip buffer, at 16 bit resolution
+static void apu_blipupdate(struct apu_s* apu, uint32_t time)
+{
+    int32_t level = apu_mix(apu)>>16;
+
+    if(level != apu->level)
     {
-        pulse1 = pulseseq[apuctx->pulse1.duty][apuctx->pulse1.phase] * apuctx->pulse1.env.out * (apuctx->pulse1.counter>0);
+        blip_add_delta(apu->blip, apu->blipclock + time - apu->phase, level - apu->level);
+        apu->level = level;
     }
+}
+
+// run the APU up to the end of the next output sample
+static inline void apu_endsample(struct apu_s* apu)
+{
+    struct apuwrite_s* w;
+    uint32_t cycles;
+
+    apu->cpu_cycles += apu->clock_cycles_per_sample;
+    cycles = apu->cpu_cycles>>16;
+
+    // queued writes that fall into this sample
+    while(apu->queue_head != apu->queue_tail)
+    {
+        w = &apu->queue[apu->queue_head & (apu->queue_size-1)];
+        if(w->time >= apu->clock + cycles)
+            break;
+
+        apu_writereg(apu, apu_sampletime(apu, w->time), w->addr, w->data);
+        ++apu->queue_head;
+    }
+
+    // whatever was not caught up to by register writes
+    apu_catchup(apu, apu->phase + cycles);
+    apu->cpu_cycles &= 0xFFFF;
+    apu->clock += cycles;
+    apu->phase = apu->clock&1;
+    apu->elapsed = apu->phase;
+
+    // the blip frame runs on over the whole block
+    if(apu->blip)
+        apu->blipclock += cycles;
+}
+
+// end the blip frame of the samples run since the last call and read 'n'
+// samples of it, the steps of which come out BLIP_HALF samples later.
+// cycle rounding makes a frame a sample short or over now and then. the
+// first time it comes up short the last sample is repeated, after that the
+// buffer runs up to two samples behind and the stream stays continuous.
+// anything further behind than that is skipped.
+static void apu_blipread(struct apu_s* apu, int16_t* out, int n)
+{
+    int avail, got;
 
-    if(!apuctx->pulse2.counter || apuctx->pulse2.sweep_silence)
-        pulse2 = 0;
+    blip_end_frame(apu->blip, apu->blipclock);
+    apu->blipclock = 0;
+
+    for(avail = blip_samples_avail(apu->blip); avail > n+2; --avail)
+        blip_read_samples(apu->blip, &apu->blipsample, 1);
+
+    got = blip_read_samples(apu->blip, out, n);
+    if(got > 0)
+        apu->blipsample = out[got-1];
+
+    for(; got < n; ++got)
+        out[got] = apu->blipsample;
+}
+
+// top 16 bits of 'level' plus those of the expansion chips' output, clipped
+static inline int16_t apu_addchips(int32_t level, int32_t ext)
+{
+    level = (level>>16) + (ext>>16);
+
+    return (level > 32767) ? 32767 : (level < -32768) ? -32768 : level;
+}
+
+int32_t apu_output(struct apu_s* apu)
+{
+    int32_t level;
+
+    if(!apu) return 0;
+
+    apu_endsample(apu);
+
+    if(apu->blip)
+    {
+        apu_blipread(apu, &apu->blipsample, 1);
+        level = (int32_t)apu->blipsample<<16;
+    }
     else
+        level = apu_mix(apu);
+
+    if(apu->nchips)
+        level = (int32_t)apu_addchips(level, apu_chipoutput(apu))<<16;
+
+    return level;
+}
+
+// the band-limited samples of a block apu_runblock() has run. the
+// expansion chips are not band-limited, their output is simply added to
+// each sample.
+static void apu_blipblock(struct apu_s* apu, int frames)
+{
+    int i;
+
+    apu_blipread(apu, apu->out_blip, frames);
+
+    if(apu->nchips)
     {
-        pulse2 = pulseseq[apuctx->pulse2.duty][apuctx->pulse2.phase] * apuctx->pulse2.env.out * (apuctx->pulse2.counter>0);
+        for(i = 0; i < frames; ++i)
+            apu->out_blip[i] = apu_addchips((int32_t)apu->out_blip[i]<<16, apu->out_ext[i]);
     }
+}
 
-    if(apuctx->tri.timer_period < 2)
-        tri = 7;
+// point the mixer at the level streams of apu_runblock()
+static void apu_mixinput(struct apu_s* apu, struct mixin_s* mix)
+{
+    mix->pulse_lut = pulse_mix_lut;
+    mix->tnd_lut = tnd_mix_lut;
+    mix->pulse1 = apu->out_pulse1;
+    mix->pulse2 = apu->out_pulse2;
+    mix->tri = apu->out_tri;
+    mix->noise = apu->out_noise;
+    mix->dmc = apu->out_dmc;
+    mix->ext = apu->nchips ? apu->out_ext : NULL;
+    mix->gain = apu->gain;
+}
+
+// emulate the next 'frames' (at most APU_BLOCK) samples, leaving the channel
+// levels of each in the out_* streams
+static void apu_runblock(struct apu_s* apu, int frames)
+{
+    int i;
+
+    if(apu->stems)
+    {
+        // every stream at once, the levels next to the band-limited mix
+        for(i = 0; i < frames; ++i)
+        {
+            apu_endsample(apu);
+            apu_levels(apu, &apu->out_pulse1[i], &apu->out_pulse2[i], &apu->out_tri[i], &apu->out_noise[i], &apu->out_dmc[i]);
+            apu->out_ext[i] = apu_chipstems(apu, i);
+        }
+
+        if(apu->blip)
+            apu_blipblock(apu, frames);
+        return;
+    }
+
+    if(apu->blip)
+    {
+        for(i = 0; i < frames; ++i)
+        {
+            apu_endsample(apu);
+            if(apu->nchips)
+                apu->out_ext[i] = apu_chipoutput(apu);
+        }
+
+        apu_blipblock(apu, frames);
+        return;
+    }
+
+    if(apu->nchips)
+    {
+        for(i = 0; i < frames; ++i)
+        {
+            apu_endsample(apu);
+            apu_levels(apu, &apu->out_pulse1[i], &apu->out_pulse2[i], &apu->out_tri[i], &apu->out_noise[i], &apu->out_dmc[i]);
+            apu->out_ext[i] = apu_chipoutput(apu);
+        }
+        return;
+    }
+
+    for(i = 0; i < frames; ++i)
+    {
+        apu_endsample(apu);
+        apu_levels(apu, &apu->out_pulse1[i], &apu->out_pulse2[i], &apu->out_tri[i], &apu->out_noise[i], &apu->out_dmc[i]);
+    }
+}
+
+// the 16 bit output of the block apu_runblock() left
+static void apu_mixblock(struct apu_s* apu, const struct mixin_s* mix, int16_t* buffer, int n)
+{
+    int32_t v;
+    int i;
+
+    if(apu->blip)
+    {
+        for(i = 0; i < n; ++i)
+        {
+            v = (apu->out_blip[i] * apu->gain)>>8;
+            buffer[i] = (v > 32767) ? 32767 : (v < -32768) ? -32768 : v;
+        }
+    }
     else
-        tri = triseq[apuctx->tri.phase];
+        mix_s16(mix, buffer, n);
+}
 
-    noise = (apuctx->noise.shiftreg&1) * apuctx->noise.env.out * (apuctx->noise.counter>0);
-    dmc = apuctx->dmc.counter;
+// fill 'buffer' with the next 'frames' samples, at unity gain the same as
+// calling apu_output() 'frames' times and keeping the top 16 bits of each
+void apu_render(struct apu_s* apu, int16_t* buffer, int frames)
+{
+    struct mixin_s mix;
+    int n;
 
-                                            // "tri + tri<<1" (tri + tri*2 == tri*3) + noise<<1 (noise*2) + dmc
-    return (int32_t)((int64_t)(apuctx->pulse_mix_lut[pulse1 + pulse2] + apuctx->tnd_mix_lut[(tri + (tri<<1)) + (noise<<1) + dmc]) - 0x7fffffffL);
+    apu_mixinput(apu, &mix);
+
+    while(frames > 0)
+    {
+        n = (frames < APU_BLOCK) ? frames : APU_BLOCK;
+        apu_runblock(apu, n);
+        apu_mixblock(apu, &mix, buffer, n);
+
+        buffer += n;
+        frames -= n;
+    }
+}
+
+static const char* const apu_stemnames[APU_STEMS_2A03] =
+{
+    "pulse1", "pulse2", "triangle", "noise", "dmc"
+};
+
+// tracks apu_renderstems() adds to the mix: the 2A03 channels, then the
+// channels of each expansion chip
+int apu_stems(struct apu_s* apu)
+{
+    return APU_STEMS_2A03 + apu->nchipstems;
+}
+
+const char* apu_stemname(struct apu_s* apu, int stem)
+{
+    int c;
+
+    if(stem < 0 || stem >= apu_stems(apu))
+        return NULL;
+
+    if(stem < APU_STEMS_2A03)
+        return apu_stemnames[stem];
+
+    stem -= APU_STEMS_2A03;
+    for(c = 0; stem >= apu->chipstems[c]; ++c)
+        stem -= apu->chipstems[c];
+
+    return apu->mappers[c]->stemnames ? apu->mappers[c]->stemnames[stem] : apu->mappers[c]->name;
 }
 
-void apu_reset(byte snd_mappers)
+// apu_render() with every stem on a track of its own as well, from the same
+// emulation. 'buffer' takes interleaved frames of 1+apu_stems() samples,
+// the mix first. a 2A03 stem is what apu_render() gives with the other
+// channels silent, point sampled even with APU_SYNTH_BLEP. an expansion
+// chip channel's stem is its own level, silent at 0, point sampled too for
+// the chips that average their output over the sample.
+void apu_renderstems(struct apu_s* apu, int16_t* buffer, int frames)
 {
-    if(!apuctx) return;
+    static const byte silent[APU_BLOCK];
+    struct mixin_s mix, solo;
+    int16_t tracks[1+APU_STEMS_2A03][APU_BLOCK];
+    int channels = 1 + apu_stems(apu);
+    int32_t v;
+    int n, i, s, c;
 
-    memset(apuctx, 0, (((int)&apuctx->envelopes) - (int)apuctx));
+    apu_mixinput(apu, &mix);
+    solo = mix;
+    solo.ext = NULL;
+
+    apu->stems = 1;
+
+    while(frames > 0)
+    {
+        n = (frames < APU_BLOCK) ? frames : APU_BLOCK;
+        apu_runblock(apu, n);
+        apu_mixblock(apu, &mix, tracks[0], n);
+
+        for(s = 0; s < APU_STEMS_2A03; ++s)
+        {
+            solo.pulse1 = (s == APU_STEM_PULSE1) ? apu->out_pulse1 : silent;
+            solo.pulse2 = (s == APU_STEM_PULSE2) ? apu->out_pulse2 : silent;
+            solo.tri = (s == APU_STEM_TRIANGLE) ? apu->out_tri : silent;
+            solo.noise = (s == APU_STEM_NOISE) ? apu->out_noise : silent;
+            solo.dmc = (s == APU_STEM_DMC) ? apu->out_dmc : silent;
+            mix_s16(&solo, tracks[1+s], n);
+        }
+
+        for(i = 0; i < n; ++i)
+        {
+            for(s = 0; s <= APU_STEMS_2A03; ++s)
+                buffer[s] = tracks[s][i];
+
+            for(c = 0; c < apu->nchipstems; ++c)
+            {
+                v = ((apu->out_chips[c][i]>>16) * apu->gain)>>8;
+                buffer[1+APU_STEMS_2A03+c] = (v > 32767) ? 32767 : (v < -32768) ? -32768 : v;
+            }
+
+            buffer += channels;
+        }
+
+        frames -= n;
+    }
+
+    apu->stems = 0;
+}
+
+// apu_render() to floats in -1.0 to 1.0
+void apu_renderf(struct apu_s* apu, float* buffer, int frames)
+{
+    struct mixin_s mix;
+    float scale = apu->gain * (1.0f/(MIX_UNITY*32768.0f));
+    float v;
+    int n, i;
+
+    apu_mixinput(apu, &mix);
+
+    while(frames > 0)
+    {
+        n = (frames < APU_BLOCK) ? frames : APU_BLOCK;
+        apu_runblock(apu, n);
+
+        if(apu->blip)
+        {
+            for(i = 0; i < n; ++i)
+            {
+                v = apu->out_blip[i] * scale;
+                buffer[i] = (v > 1.0f) ? 1.0f : (v < -1.0f) ? -1.0f : v;
+            }
+        }
+        else
+            mix_f32(&mix, buffer, n);
+
+        buffer += n;
+        frames -= n;
+    }
+}
+
+// 'snd_mappers' is the mask of APU_EXT_* chips to add to the 2A03. chips
+// that are not emulated, or can not be created, stay silent.
+void apu_reset(struct apu_s* apu, byte snd_mappers)
+{
+    const apumapper_t* mapper;
+    void* chip;
+    int j;
+
+    if(!apu) return;
+
+    memset(apu, 0, offsetof(struct apu_s, envelopes));
+    apu->queue_head = 0;
+    apu->queue_tail = 0;
+
+    if(apu->blip)
+    {
+        blip_clear(apu->blip);
+        apu->blipsample = 0;
+    }
 
     int i = 0;
     for(i = 0x00; i <= 0x13; ++i)
     {
-        apu_write(i, 0x00);
+        apu_write(apu, 0, i, 0x00);
     }
 
-    apu_write(APU_STATUS, 0x0f);
-    apu_write(APU_FRAMECNTR, 0x40);
+    apu_write(apu, 0, APU_STATUS, 0x0f);
+    apu_write(apu, 0, APU_FRAMECNTR, 0x40);
+
+    apu->noise.shiftreg = 1;
+
+    apu_freechips(apu);
+    for(i = 0; i < APU_MAPPERS; ++i)
+    {
+        mapper = apu_mappertable[i];
+        if(!BIT(snd_mappers, i) || !mapper)
+            continue;
+
+        chip = mapper->init(apu->cpu_clock);
+        if(!chip)
+            continue;
+
+        mapper->reset(chip);
+        if(mapper->option)
+        {
+            for(j = 0; j < APU_OPTIONS; ++j)
+                mapper->option(chip, j, apu->options[j]);
+        }
+
+        apu->mappers[apu->nchips] = mapper;
+        apu->chips[apu->nchips] = chip;
+        apu->chipstems[apu->nchips] = 1;
+        if(mapper->stemnames)
+        {
+            j = 0;
+            while(mapper->stemnames[j])
+                ++j;
+            apu->chipstems[apu->nchips] = j;
+        }
+        apu->nchipstems += apu->chipstems[apu->nchips];
+        ++apu->nchips;
+    }
 
-    apuctx->noise.shiftreg = 1;
+#ifdef NSF_STATS
+    memset(&apu->stats, 0, sizeof(apu->stats));
+#endif
 }
 
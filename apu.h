@@ -4,40 +4,125 @@
 #include "M6502/M6502.h"
 #include <stdint.h>
 
-typedef void (*mapperinit_t)(void);
-typedef void (*mappercleanup_t)(void);
-typedef int (*mapperwrite_t)(word addr, byte data);
-typedef int (*mapperread_t)(word addr);
-typedef void (*mapperreset_t)(void);
-typedef void (*mapperprocess_t)(int cycles);
-typedef int32_t (*mapperoutput_t)(void);
+// Expansion sound chips. Each chip is its own module that exports an
+// apumapper_t; apu_reset() creates the chips a tune asks for and from then
+// on the APU hands them their register writes and reads, runs them up to
+// every write and to the end of every output sample, and adds their
+// output to the mix. Tunes without any pay nothing for them.
+//
+// 'chip' is the state init() returned. Levels are in apu_output() units,
+// where the whole 2A03 mix spans the signed 32 bit range.
+typedef void* (*mapperinit_t)(uint32_t cpu_clock);
+typedef void (*mappercleanup_t)(void* chip);
+typedef int (*mapperwrite_t)(void* chip, word addr, byte data);
+typedef int (*mapperread_t)(void* chip, word addr);
+typedef void (*mapperreset_t)(void* chip);
+typedef void (*mapperprocess_t)(void* chip, uint32_t cycles);
+typedef int32_t (*mapperoutput_t)(void* chip);
+typedef void (*mapperoption_t)(void* chip, int option, int value);
+typedef void (*mapperstems_t)(void* chip, int32_t* levels);
 
 typedef struct apumapper_s
 {
-    mapperinit_t init;
+    const char* name;
+    mapperinit_t init;          // returns the chip's state, NULL if it can not be created
     mappercleanup_t cleanup;
     mapperreset_t reset;        // resets all mapper states and registers to default
     mapperwrite_t write;        // attempt to write to this mapper. return 1 if address is in range
     mapperread_t read;          // attempt to read from this mapper. return -1 if address not in range.
-    mapperprocess_t process;    // process x cycles for this mapper. returns a signed 32 bit sample of the output
-    mapperoutput_t output;
+    word readfirst;             // addresses read() can answer, 0 to 0 for a write only chip
+    word readlast;
+    mapperprocess_t process;    // run the chip for this many CPU cycles
+    mapperoutput_t output;      // current output level
+    mapperoption_t option;      // apu_setoption() settings, NULL if the chip has none
+    const char* const* stemnames; // of the chip's channels, NULL terminated. NULL if the chip is one stem
+    mapperstems_t stems;        // current level of each of those channels, NULL with 'stemnames'
 }apumapper_t;
 
+// apu_reset() mapper bits, as in the NSF header's extsnd byte
+#define APU_EXT_VRC6    0x01
+#define APU_EXT_VRC7    0x02
+#define APU_EXT_FDS     0x04
+#define APU_EXT_MMC5    0x08
+#define APU_EXT_N163    0x10
+#define APU_EXT_5B      0x20
+#define APU_MAPPERS     6
+
+// apu_setoption() settings of the expansion chips
+#define APU_OPT_N163_MIX    0   // APU_N163_*
+#define APU_OPTIONS         1
+
+#define APU_N163_MULTIPLEX  0   // channels take turns on the output, like on the chip
+#define APU_N163_AVERAGE    1   // channels mixed evenly, cheaper and without the whine
+
+// 2A03 tables the MMC5 pulses use as well
+extern const byte pulseseq[4][8];
+extern const byte length_lut[32];
+
 #define APU_NTSC 0
 #define APU_PAL 1
 
+#define APU_SYNTH_POINT 0   // channels sampled once per output sample
+#define APU_SYNTH_BLEP  1   // band-limited steps, no aliasing
+
+#define APU_BLOCK 256         // samples apu_render() emulates before mixing them
+
+// apu_renderstems() tracks after the mix, then one per expansion chip
+// channel, or per chip for chips without apumapper_t stemnames
+#define APU_STEM_PULSE1     0
+#define APU_STEM_PULSE2     1
+#define APU_STEM_TRIANGLE   2
+#define APU_STEM_NOISE      3
+#define APU_STEM_DMC        4
+#define APU_STEMS_2A03      5
+#define APU_STEMS_EXT       24  // expansion chip channels, all chips together
+
 #define BIT(v, b) (((v>>b)&1) == 1)
 
+// build with NSF_STATS to count what the emulation does. STAT() statements
+// are compiled out otherwise, so the counters cost nothing in normal builds.
+#ifdef NSF_STATS
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
+
+typedef byte (*apumemread_t)(void* param, word addr);
+
 struct apu_s;
 
 struct apu_s* apu_create(int samplerate, byte clockstandard);
 void apu_destroy(struct apu_s* apu);
-void apu_setcontext(struct apu_s* apu);
-void apu_write(word addr, byte data);
-byte apu_read(word addr);
-void apu_process(uint32_t cpu_cycles);
-int32_t apu_output(void);
-void apu_reset(byte snd_mappers);
+void apu_setmemread(struct apu_s* apu, apumemread_t read, void* param);
+int apu_setsynthesis(struct apu_s* apu, byte mode);
+void apu_setgain(struct apu_s* apu, float gain);
+void apu_write(struct apu_s* apu, uint64_t time, word addr, byte data);
+byte apu_read(struct apu_s* apu, uint64_t time, word addr);
+int32_t apu_output(struct apu_s* apu);
+void apu_render(struct apu_s* apu, int16_t* buffer, int frames);
+void apu_renderf(struct apu_s* apu, float* buffer, int frames);
+int apu_stems(struct apu_s* apu);
+const char* apu_stemname(struct apu_s* apu, int stem);
+void apu_renderstems(struct apu_s* apu, int16_t* buffer, int frames);
+void apu_reset(struct apu_s* apu, byte snd_mappers);
+uint32_t apu_cpuclock(struct apu_s* apu);
+uint64_t apu_clock(struct apu_s* apu);
+uint32_t apu_samplesbefore(struct apu_s* apu, uint64_t time);
+byte apu_mappers(void);
+void apu_setoption(struct apu_s* apu, int option, int value);
+const char* apu_mappername(int bit);
+
+#ifdef NSF_STATS
+struct apustats_s
+{
+    uint64_t writes[0x18];      // writes to each register, $4000-$4017
+    uint64_t quarter_frames;
+    uint64_t half_frames;
+    uint64_t dmc_fetches;       // sample bytes read by the DMC
+};
+
+void apu_stats(struct apu_s* apu, struct apustats_s* stats);
+#endif
 
 
 
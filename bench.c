@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "nsf.h"
+#include "apu.h"
+#include "mix.h"
+#include "sink.h"
+#include "verify.h"
+
+// Throughput benchmark: renders a fixed stretch of every song of every
+// tune given, through the null sink, and reports how fast the emulation
+// ran and where the time went.
+
+#define SAMPLE_RATE     48000
+#define BENCH_SECONDS   30
+
+#define BENCH_TABLE 0
+#define BENCH_CSV   1
+#define BENCH_JSON  2
+
+struct benchresult_s
+{
+    const char* file;
+    int song;               // 1 based, 0 for the total
+    double seconds;         // emulated
+    double wall;            // seconds it took
+    double cycles;          // emulated CPU cycles
+    double frames;
+    double cpu_ns;          // in the 6502 routines
+    double apu_ns;          // rendering samples
+    double cpu_cycles;      // 6502 cycles the routines took
+};
+
+static int bench_cmp(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int bench_isnsf(const char* name)
+{
+    const char* ext = strrchr(name, '.');
+
+    return ext && (strcasecmp(ext, ".nsf") == 0);
+}
+
+// every .nsf in 'dir', sorted so runs line up
+static int bench_listdir(const char* dir, char*** files, int* count)
+{
+    DIR* d;
+    struct dirent* ent;
+    char** list;
+    char* path;
+    int first = *count;
+
+    d = opendir(dir);
+    if(!d)
+        return 0;
+
+    while((ent = readdir(d)) != NULL)
+    {
+        if(!bench_isnsf(ent->d_name))
+            continue;
+
+        list = realloc(*files, (*count+1)*sizeof(char*));
+        if(!list)
+        {
+            closedir(d);
+            return 0;
+        }
+        *files = list;
+
+        path = malloc(strlen(dir) + strlen(ent->d_name) + 2);
+        if(!path)
+        {
+            closedir(d);
+            return 0;
+        }
+
+        sprintf(path, "%s/%s", dir, ent->d_name);
+        (*files)[(*count)++] = path;
+    }
+
+    closedir(d);
+
+    qsort(*files + first, *count - first, sizeof(char*), bench_cmp);
+    return 1;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int bench_song(struct nsf_s* nsf, const char* file, int song, int seconds, struct benchresult_s* result)
+{
+    struct sink_s* sink;
+    struct sinkformat_s format;
+    struct nsfprofile_s profile;
+    int16_t* buffer;
+    uint32_t total = (uint32_t)seconds*SAMPLE_RATE;
+    uint32_t len;
+    double start;
+
+    memset(&format, 0, sizeof(format));
+    format.rate = SAMPLE_RATE;
+    format.channels = 1;
+
+    sink = sink_open(SINK_NULL, NULL, &format);
+    if(!sink)
+        return 0;
+
+    start = bench_now();
+
+    nsf_setprofiling(nsf, 1);
+    if(!nsf_init(nsf, song-1))
+    {
+        sink_close(sink);
+        return 0;
+    }
+
+    buffer = malloc(nsf_playsamples(nsf)*4*sizeof(int16_t));
+    if(!buffer)
+    {
+        sink_close(sink);
+        return 0;
+    }
+
+    while(sink_frames(sink) < total)
+    {
+        len = nsf_playsamples(nsf)*4;
+        if(total - sink_frames(sink) < len)
+            len = total - sink_frames(sink);
+
+        nsf_render(nsf, buffer, len);
+        sink_write(sink, buffer, len);
+    }
+
+    result->wall = bench_now() - start;
+
+    nsf_profile(nsf, &profile);
+
+    result->file = file;
+    result->song = song;
+    result->frames = profile.frames;
+    result->seconds = profile.frames / (double)SAMPLE_RATE;
+    result->cycles = result->seconds * profile.cpu_clock;
+    result->cpu_ns = profile.cpu_ns;
+    result->apu_ns = profile.apu_ns;
+    result->cpu_cycles = profile.cpu_cycles;
+
+    free(buffer);
+    sink_close(sink);
+    return 1;
+}
+
+static void bench_add(struct benchresult_s* total, const struct benchresult_s* r)
+{
+    total->seconds += r->seconds;
+    total->wall += r->wall;
+    total->cycles += r->cycles;
+    total->frames += r->frames;
+    total->cpu_ns += r->cpu_ns;
+    total->apu_ns += r->apu_ns;
+    total->cpu_cycles += r->cpu_cycles;
+}
+
+// 'name' as a quoted CSV field or JSON string
+static void bench_putname(int format, const char* name)
+{
+    const unsigned char* c;
+
+    putchar('"');
+    for(c = (const unsigned char*)name; *c; ++c)
+    {
+        if(format == BENCH_CSV)
+        {
+            // quotes are doubled, anything else goes as it is
+            if(*c == '"')
+                putchar('"');
+            putchar(*c);
+        }
+        else
+        if(*c == '"' || *c == '\\')
+            printf("\\%c", *c);
+        else
+        if(*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+static void bench_print(int format, const struct benchresult_s* r, int first)
+{
+    double ns = r->wall*1e9;
+    double realtime = r->seconds / r->wall;
+    double nspercycle = ns / r->cycles;
+    double nspersample = ns / r->frames;
+    double cpupct = 100.0*r->cpu_ns / ns;
+    double apupct = 100.0*r->apu_ns / ns;
+    double load = 100.0*r->cpu_cycles / r->cycles;     // of the emulated CPU's time
+    const char* song = r->song ? "" : "total";
+
+    switch(format)
+    {
+        case BENCH_CSV:
+            if(first)
+                printf("file,song,seconds,wall_s,realtime,ns_per_cycle,ns_per_sample,cpu_pct,apu_pct,cpu_load_pct\n");
+            bench_putname(format, r->file);
+            printf(",%i,%.3f,%.6f,%.2f,%.4f,%.2f,%.2f,%.2f,%.2f\n", r->song, r->seconds, r->wall,
+                   realtime, nspercycle, nspersample, cpupct, apupct, load);
+            break;
+
+        case BENCH_JSON:
+            printf("%s  {\"file\": ", first ? "" : ",\n");
+            bench_putname(format, r->file);
+            printf(", \"song\": %i, \"seconds\": %.3f, \"wall_s\": %.6f, \"realtime\": %.2f, "
+                   "\"ns_per_cycle\": %.4f, \"ns_per_sample\": %.2f, \"cpu_pct\": %.2f, \"apu_pct\": %.2f, \"cpu_load_pct\": %.2f}",
+                   r->song, r->seconds, r->wall,
+                   realtime, nspercycle, nspersample, cpupct, apupct, load);
+            break;
+
+        default:
+            if(first)
+                printf("%-40s %4s %9s %8s %8s %8s %6s %6s %6s\n", "file", "song", "realtime", "ns/cyc", "ns/smp", "wall", "6502%", "apu%", "load%");
+            if(r->song)
+                printf("%-40.40s %4i %8.1fx %8.3f %8.1f %7.2fs %6.1f %6.1f %6.1f\n", r->file, r->song,
+                       realtime, nspercycle, nspersample, r->wall, cpupct, apupct, load);
+            else
+                printf("%-40.40s %4s %8.1fx %8.3f %8.1f %7.2fs %6.1f %6.1f %6.1f\n", r->file, song,
+                       realtime, nspercycle, nspersample, r->wall, cpupct, apupct, load);
+            break;
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr,"Usage: tinynsf-bench [options] dir|file.nsf ...\n");
+    fprintf(stderr,"  -t seconds  emulated seconds per song (default: %i)\n", BENCH_SECONDS);
+    fprintf(stderr,"  -1          only the start song of each tune\n");
+    fprintf(stderr,"  -f format   table, csv or json (default: table)\n");
+    fprintf(stderr,"  -b          band-limited synthesis\n");
+    fprintf(stderr,"  -m mixer    scalar, sse2 or avx2 (default: the best the CPU has)\n");
+    fprintf(stderr,"\n");
+    fprintf(stderr,"Golden output checks, instead of timing:\n");
+    fprintf(stderr,"  -w golden   hash every song and write the hashes to 'golden', with -b both ways\n");
+    fprintf(stderr,"  -c golden   render the songs listed in 'golden' and compare hashes\n");
+    fprintf(stderr,"  -x dir      with -c, also compare samples to the raw files tinynsf -r -d wrote to dir\n");
+    fprintf(stderr,"  -e diff     with -x, pass songs whose samples differ by at most this (default: 0)\n");
+    fprintf(stderr,"  -j threads  songs rendered at once (default: one per CPU)\n");
+}
+
+// hash every song of every file into 'golden', point sampled and, with
+// 'blep', band-limited as well
+static int bench_write(const char* golden, char** files, int count, int seconds, int blep, int startOnly, int threads)
+{
+    struct verifyjob_s* jobs = NULL;
+    struct verifyjob_s* grown;
+    struct nsf_s* nsf;
+    int modes = blep ? 2 : 1;
+    int error, songs, start, song, mode, i, failed;
+    int n = 0;
+
+    for(i = 0; i < count; ++i)
+    {
+        nsf = nsf_open(files[i], SAMPLE_RATE, &error);
+        if(!nsf)
+        {
+            fprintf(stderr, "%s: %s\n", files[i], nsf_strerror(error));
+            verify_freejobs(jobs, n);
+            return 0;
+        }
+        songs = nsf_header(nsf)->songs;
+        start = nsf_header(nsf)->start;
+        nsf_close(nsf);
+
+        grown = realloc(jobs, (n+modes*songs)*sizeof(struct verifyjob_s));
+        if(!grown)
+        {
+            verify_freejobs(jobs, n);
+            return 0;
+        }
+        jobs = grown;
+
+        for(song = 1; song <= songs; ++song)
+        {
+            if(startOnly && song != start)
+                continue;
+
+            for(mode = 0; mode < modes; ++mode)
+            {
+                memset(&jobs[n], 0, sizeof(struct verifyjob_s));
+                jobs[n].nsffile = strdup(files[i]);
+                jobs[n].song = song;
+                jobs[n].seconds = seconds;
+                jobs[n].synthesis = mode ? APU_SYNTH_BLEP : APU_SYNTH_POINT;
+                ++n;
+
+                if(!jobs[n-1].nsffile)
+                {
+                    verify_freejobs(jobs, n);
+                    return 0;
+                }
+            }
+        }
+    }
+
+    failed = verify_run(jobs, n, threads, NULL);
+    if(failed)
+        fprintf(stderr, "%i of %i songs could not be rendered\n", failed, n);
+
+    if(!verify_save(golden, jobs, n))
+    {
+        fprintf(stderr, "Could not write \'%s\'.\n", golden);
+        failed = n;
+    }
+    else
+        printf("%i songs hashed into \'%s\'\n", n-failed, golden);
+
+    verify_freejobs(jobs, n);
+    return failed == 0;
+}
+
+// render everything in 'golden' again and fail on any difference
+static int bench_check(const char* golden, int threads, const char* refdir, int tolerance)
+{
+    struct verifyjob_s* jobs;
+    int count, i, bad = 0;
+
+    jobs = verify_load(golden, &count);
+    if(!jobs)
+    {
+        fprintf(stderr, "Could not read \'%s\'.\n", golden);
+        return 0;
+    }
+
+    verify_run(jobs, count, threads, refdir);
+
+    for(i = 0; i < count; ++i)
+    {
+        if(!jobs[i].result)
+        {
+            printf("FAIL %s:%i could not be rendered\n", jobs[i].nsffile, jobs[i].song);
+            ++bad;
+        }
+        else
+        if(jobs[i].hash != jobs[i].expected)
+        {
+            // with a reference, small enough differences may pass
+            if(refdir && jobs[i].maxdiff >= 0 && jobs[i].maxdiff <= tolerance)
+            {
+                printf("ok   %s:%i differs by at most %i\n", jobs[i].nsffile, jobs[i].song, jobs[i].maxdiff);
+                continue;
+            }
+
+            printf("FAIL %s:%i hash %016llx, expected %016llx", jobs[i].nsffile, jobs[i].song,
+                   (unsigned long long)jobs[i].hash, (unsigned long long)jobs[i].expected);
+            if(refdir)
+            {
+                if(jobs[i].maxdiff >= 0)
+                    printf(", samples differ by up to %i", jobs[i].maxdiff);
+                else
+                    printf(", no usable reference");
+            }
+            printf("\n");
+            ++bad;
+        }
+    }
+
+    if(bad)
+        printf("FAILED: %i of %i songs changed\n", bad, count);
+    else
+        printf("OK: all %i songs match\n", count);
+
+    verify_freejobs(jobs, count);
+    return bad == 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct benchresult_s result, total;
+    struct nsf_s* nsf;
+    struct stat st;
+    char** files = NULL;
+    char** grown;
+    int count = 0;
+    int seconds = BENCH_SECONDS;
+    int startOnly = 0;
+    int format = BENCH_TABLE;
+    byte synthesis = APU_SYNTH_POINT;
+    int first = 1;
+    int failed = 0;
+    const char* writeGolden = NULL;
+    const char* checkGolden = NULL;
+    const char* refDir = NULL;
+    int tolerance = 0;
+    int threads = 0;
+    int opt, error, i, song, songs;
+
+    while((opt = getopt(argc, argv, "t:1f:bm:w:c:x:e:j:")) != -1)
+    {
+        switch(opt)
+        {
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            case '1':
+                startOnly = 1;
+                break;
+            case 'f':
+                if(strcmp(optarg, "csv") == 0)
+                    format = BENCH_CSV;
+                else
+                if(strcmp(optarg, "json") == 0)
+                    format = BENCH_JSON;
+                else
+                    format = BENCH_TABLE;
+                break;
+            case 'b':
+                synthesis = APU_SYNTH_BLEP;
+                break;
+            case 'm':
+                if(strcmp(optarg, "avx2") == 0)
+                    mix_setimpl(MIX_AVX2);
+                else
+                if(strcmp(optarg, "sse2") == 0)
+                    mix_setimpl(MIX_SSE2);
+                else
+                    mix_setimpl(MIX_SCALAR);
+                break;
+            case 'w':
+                writeGolden = optarg;
+                break;
+            case 'c':
+                checkGolden = optarg;
+                break;
+            case 'x':
+                refDir = optarg;
+                break;
+            case 'e':
+                tolerance = atoi(optarg);
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // the golden file says what to render
+    if(checkGolden != NULL)
+        return bench_check(checkGolden, threads, refDir, tolerance) ? 0 : EXIT_FAILURE;
+
+    if(optind >= argc || seconds <= 0)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    for(i = optind; i < argc; ++i)
+    {
+        if(stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            if(!bench_listdir(argv[i], &files, &count))
+            {
+                fprintf(stderr, "Could not read directory \'%s\'.\n", argv[i]);
+                failed = 1;
+                goto bench_done;
+            }
+        }
+        else
+        {
+            grown = realloc(files, (count+1)*sizeof(char*));
+            if(!grown)
+                goto bench_nomem;
+            files = grown;
+
+            files[count] = strdup(argv[i]);
+            if(!files[count])
+                goto bench_nomem;
+            ++count;
+        }
+    }
+
+    if(writeGolden != NULL)
+    {
+        failed = !bench_write(writeGolden, files, count, seconds, synthesis == APU_SYNTH_BLEP, startOnly, threads);
+        goto bench_done;
+    }
+
+    fprintf(stderr, "%i files, %i s per song, mixer %s\n", count, seconds, mix_implname(mix_getimpl()));
+
+    memset(&total, 0, sizeof(total));
+    total.file = "all";
+
+    if(format == BENCH_JSON)
+        printf("[\n");
+
+    for(i = 0; i < count; ++i)
+    {
+        nsf = nsf_open(files[i], SAMPLE_RATE, &error);
+        if(!nsf)
+        {
+            fprintf(stderr, "%s: %s\n", files[i], nsf_strerror(error));
+            ++failed;
+            continue;
+        }
+
+        nsf_setsynthesis(nsf, synthesis);
+
+        songs = nsf_header(nsf)->songs;
+        for(song = 1; song <= songs; ++song)
+        {
+            if(startOnly && song != nsf_header(nsf)->start)
+                continue;
+
+            if(!bench_song(nsf, files[i], song, seconds, &result))
+            {
+                fprintf(stderr, "%s: song %i failed\n", files[i], song);
+                ++failed;
+                continue;
+            }
+
+            bench_print(format, &result, first);
+            bench_add(&total, &result);
+            first = 0;
+        }
+
+        nsf_close(nsf);
+    }
+
+    if(total.frames > 0)
+        bench_print(format, &total, first);
+
+    if(format == BENCH_JSON)
+        printf("\n]\n");
+
+    goto bench_done;
+
+bench_nomem:
+    fprintf(stderr, "Out of memory.\n");
+    failed = 1;
+
+bench_done:
+    for(i = 0; i < count; ++i)
+        free(files[i]);
+    free(files);
+
+    return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,162 @@
+#include "blip.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define BLIP_UNIT_BITS  13      // every kernel phase sums to 1<<BLIP_UNIT_BITS
+#define BLIP_CUTOFF     0.9     // of the Nyquist frequency
+
+struct blip_s
+{
+    uint64_t factor;        // samples per clock, 32.32 fixed point
+    uint64_t offset;        // start of the current frame in samples, 32.32
+    int32_t integrator;
+    int size;               // samples the buffer holds
+    int32_t* buf;           // size + BLIP_WIDTH deltas
+};
+
+static int16_t blip_kernel[BLIP_PHASES][BLIP_WIDTH];
+static pthread_once_t blip_kernel_once = PTHREAD_ONCE_INIT;
+
+// windowed sinc impulses, one per sub-sample phase, each normalized so a
+// step of 'delta' adds up to exactly 'delta' once integrated
+static void blip_make_kernel(void)
+{
+    double taps[BLIP_WIDTH];
+    double x, sum;
+    int p, i, total, largest;
+
+    for(p = 0; p < BLIP_PHASES; ++p)
+    {
+        sum = 0.0;
+        for(i = 0; i < BLIP_WIDTH; ++i)
+        {
+            x = i - BLIP_HALF + 0.5 - (double)p/BLIP_PHASES;
+
+            if(fabs(x) < 1e-9)
+                taps[i] = BLIP_CUTOFF;
+            else
+                taps[i] = sin(M_PI*BLIP_CUTOFF*x) / (M_PI*x);
+
+            // blackman window over -BLIP_HALF..BLIP_HALF
+            taps[i] *= 0.42 + 0.5*cos(M_PI*x/BLIP_HALF) + 0.08*cos(2.0*M_PI*x/BLIP_HALF);
+            sum += taps[i];
+        }
+
+        total = 0;
+        largest = 0;
+        for(i = 0; i < BLIP_WIDTH; ++i)
+        {
+            blip_kernel[p][i] = (int16_t)floor(taps[i] / sum * (1<<BLIP_UNIT_BITS) + 0.5);
+            total += blip_kernel[p][i];
+
+            if(blip_kernel[p][i] > blip_kernel[p][largest])
+                largest = i;
+        }
+
+        // put the rounding error where it matters least
+        blip_kernel[p][largest] += (1<<BLIP_UNIT_BITS) - total;
+    }
+}
+
+struct blip_s* blip_create(uint32_t clocks_per_sample, int maxsamples)
+{
+    struct blip_s* blip;
+
+    pthread_once(&blip_kernel_once, blip_make_kernel);
+
+    blip = malloc(sizeof(struct blip_s));
+    if(!blip) return NULL;
+
+    // clocks_per_sample is 16.16 fixed point, round the factor up so that
+    // the clocks of n samples never make less than n samples
+    blip->factor = (((uint64_t)1<<48) + clocks_per_sample - 1) / clocks_per_sample;
+    blip->size = maxsamples;
+    blip->buf = malloc((maxsamples + BLIP_WIDTH)*sizeof(int32_t));
+    if(!blip->buf)
+    {
+        free(blip);
+        return NULL;
+    }
+
+    blip_clear(blip);
+    return blip;
+}
+
+void blip_destroy(struct blip_s* blip)
+{
+    if(blip == NULL)
+        return;
+
+    free(blip->buf);
+    free(blip);
+}
+
+void blip_clear(struct blip_s* blip)
+{
+    blip->offset = 0;
+    blip->integrator = 0;
+    memset(blip->buf, 0, (blip->size + BLIP_WIDTH)*sizeof(int32_t));
+}
+
+void blip_add_delta(struct blip_s* blip, uint32_t time, int32_t delta)
+{
+    uint64_t pos = blip->offset + time*blip->factor;
+    int32_t* out = blip->buf + (pos>>32);
+    const int16_t* k = blip_kernel[(pos>>(32-BLIP_PHASE_BITS)) & (BLIP_PHASES-1)];
+    int i;
+
+    // deltas past the end of the buffer are the caller's bug, drop them
+    if((pos>>32) >= (uint64_t)blip->size)
+        return;
+
+    for(i = 0; i < BLIP_WIDTH; ++i)
+        out[i] += k[i]*delta;
+}
+
+void blip_end_frame(struct blip_s* blip, uint32_t clocks)
+{
+    blip->offset += clocks*blip->factor;
+
+    if((blip->offset>>32) > (uint64_t)blip->size)
+        blip->offset = ((uint64_t)blip->size<<32) | (blip->offset&0xFFFFFFFF);
+}
+
+int blip_samples_avail(struct blip_s* blip)
+{
+    return blip->offset>>32;
+}
+
+int blip_read_samples(struct blip_s* blip, int16_t* out, int count)
+{
+    int32_t sum = blip->integrator;
+    int32_t s;
+    int avail = blip_samples_avail(blip);
+    int remain;
+    int i;
+
+    if(count > avail)
+        count = avail;
+
+    for(i = 0; i < count; ++i)
+    {
+        sum += blip->buf[i];
+        s = sum>>BLIP_UNIT_BITS;
+
+        if(s > 32767) s = 32767;
+        else
+        if(s < -32768) s = -32768;
+
+        out[i] = s;
+    }
+    blip->integrator = sum;
+
+    // move the rest, including the tails of the last steps, to the front
+    remain = avail - count + BLIP_WIDTH;
+    memmove(blip->buf, blip->buf+count, remain*sizeof(int32_t));
+    memset(blip->buf+remain, 0, count*sizeof(int32_t));
+    blip->offset -= (uint64_t)count<<32;
+
+    return count;
+}
@@ -0,0 +1,30 @@
+#ifndef BLIP_H_INCLUDED
+#define BLIP_H_INCLUDED
+
+#include <stdint.h>
+
+// Band-limited step synthesis. Instead of point sampling a signal, every
+// change of its level is added as a delta at the clock it happened on, and
+// spread over a few output samples with a windowed sinc step. Reading the
+// buffer integrates the deltas back into samples.
+//
+// Time is counted in clocks from the start of the current frame. A frame
+// is ended with blip_end_frame(), after which the samples it completed can
+// be read.
+
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES     (1<<BLIP_PHASE_BITS)    // sub-sample positions of a step
+#define BLIP_HALF       8
+#define BLIP_WIDTH      (BLIP_HALF*2)           // samples touched by one step
+
+struct blip_s;
+
+struct blip_s* blip_create(uint32_t clocks_per_sample, int maxsamples);
+void blip_destroy(struct blip_s* blip);
+void blip_clear(struct blip_s* blip);
+void blip_add_delta(struct blip_s* blip, uint32_t time, int32_t delta);
+void blip_end_frame(struct blip_s* blip, uint32_t clocks);
+int blip_samples_avail(struct blip_s* blip);
+int blip_read_samples(struct blip_s* blip, int16_t* out, int count);
+
+#endif // BLIP_H_INCLUDED
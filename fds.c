@@ -0,0 +1,344 @@
+#include "fds.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FDS_WAVE        0x4040  // $4040-$407F
+#define FDS_VOLENV      0x4080
+#define FDS_FREQLO      0x4082
+#define FDS_FREQHI      0x4083
+#define FDS_MODENV      0x4084
+#define FDS_MODCOUNTER  0x4085
+#define FDS_MODFREQLO   0x4086
+#define FDS_MODFREQHI   0x4087
+#define FDS_MODTABLE    0x4088
+#define FDS_MASTER      0x4089
+#define FDS_ENVSPEED    0x408A
+#define FDS_VOLGAIN     0x4090
+#define FDS_MODGAIN     0x4092
+
+// one step of sample*volume*fds_master[], at most 63*32*60. full volume is
+// about twice as loud as a full 2A03 pulse.
+#define FDS_LEVEL       10240
+
+// position in the wave and modulation tables, 6.16 fixed point
+#define FDS_PHASE_MASK  0x3FFFFF
+
+// master volume 2/2, 2/3, 2/4 and 2/5
+static const int32_t fds_master[4] = {60, 40, 30, 24};
+
+// modulation table entries, added to the counter. 4 resets it instead.
+static const int8_t fds_modsteps[8] = {0, 1, 2, 4, 0, -4, -2, -1};
+
+struct fdsenv_s
+{
+    byte disabled;      // the gain is set directly
+    byte increase;
+    byte speed;
+    byte gain;          // 0-63, the envelope itself only goes up to 32
+    uint32_t timer;     // cycles since its last step
+};
+
+struct fds_s
+{
+    byte wave[64];      // 6 bit samples
+    byte modtable[64];  // 3 bit fds_modsteps[] indexes
+    struct fdsenv_s vol;
+    struct fdsenv_s mod;
+
+    word freq;          // 12 bit
+    word modfreq;
+    byte wavehalt;      // $4083 bit 7, also resets the wave position
+    byte envhalt;       // $4083 bit 6
+    byte modhalt;       // $4087 bit 7, the table may then be written
+    byte wavewrite;     // $4089 bit 7, the wave may be written, output holds
+    byte master;
+    byte envspeed;      // $408A, 0 stops both envelopes
+
+    byte counter;       // 7 bit signed modulation counter
+    byte volout;        // volume gain, taken at the start of every wave cycle
+    byte sample;        // last output while the wave is written
+    uint32_t waveacc;
+    uint32_t modacc;
+
+    // freq bent by the counter and the modulation gain. kept up to date as
+    // those change, which is a lot less often than the wave steps.
+    uint32_t pitch;
+};
+
+static void fds_modulate(struct fds_s* fds)
+{
+    int32_t counter = (fds->counter < 64) ? fds->counter : fds->counter - 128;
+    int32_t bend, remainder;
+
+    if(!fds->mod.gain)
+    {
+        fds->pitch = fds->freq;
+        return;
+    }
+
+    // the rounding of the chip, bend ends up -64 to 191 64ths of freq
+    bend = counter * fds->mod.gain;
+    remainder = bend & 0x0F;
+    bend >>= 4;
+    if(remainder && !(bend & 0x80))
+        bend += (counter < 0) ? -1 : 2;
+
+    if(bend >= 192)
+        bend -= 256;
+    else
+    if(bend < -64)
+        bend += 256;
+
+    bend *= fds->freq;
+    remainder = bend & 0x3F;
+    bend >>= 6;
+    if(remainder >= 32)
+        ++bend;
+
+    fds->pitch = fds->freq + bend;
+}
+
+static void* fds_init(uint32_t cpu_clock)
+{
+    return calloc(1, sizeof(struct fds_s));
+}
+
+static void fds_cleanup(void* chip)
+{
+    free(chip);
+}
+
+static void fds_reset(void* chip)
+{
+    struct fds_s* fds = chip;
+
+    memset(fds, 0, sizeof(struct fds_s));
+    fds->envspeed = 0xE8;
+    fds->vol.disabled = 1;
+    fds->mod.disabled = 1;
+}
+
+static void fds_env_write(struct fdsenv_s* env, byte data)
+{
+    env->disabled = BIT(data, 7);
+    env->increase = BIT(data, 6);
+    env->speed = data&0x3F;
+    env->timer = 0;
+
+    if(env->disabled)
+        env->gain = data&0x3F;
+}
+
+static int fds_write(void* chip, word addr, byte data)
+{
+    struct fds_s* fds = chip;
+
+    if( (addr >= FDS_WAVE) && (addr < FDS_VOLENV) )
+    {
+        if(fds->wavewrite)
+            fds->wave[addr&0x3F] = data&0x3F;
+        return 1;
+    }
+
+    switch(addr)
+    {
+        case FDS_VOLENV:
+            fds_env_write(&fds->vol, data);
+            break;
+        case FDS_FREQLO:
+            fds->freq = (fds->freq&0xF00) | data;
+            fds_modulate(fds);
+            break;
+        case FDS_FREQHI:
+            fds->freq = (fds->freq&0x0FF) | ((data&0x0F)<<8);
+            fds->wavehalt = BIT(data, 7);
+            fds->envhalt = BIT(data, 6);
+            if(fds->wavehalt)
+                fds->waveacc = 0;
+            fds_modulate(fds);
+            break;
+        case FDS_MODENV:
+            fds_env_write(&fds->mod, data);
+            fds_modulate(fds);
+            break;
+        case FDS_MODCOUNTER:
+            fds->counter = data&0x7F;
+            fds_modulate(fds);
+            break;
+        case FDS_MODFREQLO:
+            fds->modfreq = (fds->modfreq&0xF00) | data;
+            break;
+        case FDS_MODFREQHI:
+            fds->modfreq = (fds->modfreq&0x0FF) | ((data&0x0F)<<8);
+            fds->modhalt = BIT(data, 7);
+            if(fds->modhalt)
+                fds->modacc &= ~0xFFFF;
+            break;
+        case FDS_MODTABLE:
+            // written in pairs at the current position, which moves on
+            if(fds->modhalt)
+            {
+                fds->modtable[(fds->modacc>>16)&0x3F] = data&0x07;
+                fds->modtable[((fds->modacc>>16)+1)&0x3F] = data&0x07;
+                fds->modacc = (fds->modacc + 0x20000) & FDS_PHASE_MASK;
+            }
+            break;
+        case FDS_MASTER:
+            fds->wavewrite = BIT(data, 7);
+            fds->master = data&0x03;
+            break;
+        case FDS_ENVSPEED:
+            fds->envspeed = data;
+            break;
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+static int fds_read(void* chip, word addr)
+{
+    struct fds_s* fds = chip;
+
+    // the upper bits are open bus, usually $40
+    if( (addr >= FDS_WAVE) && (addr < FDS_VOLENV) )
+        return fds->wave[addr&0x3F] | 0x40;
+    if(addr == FDS_VOLGAIN)
+        return fds->vol.gain | 0x40;
+    if(addr == FDS_MODGAIN)
+        return fds->mod.gain | 0x40;
+
+    return -1;
+}
+
+// cycles until the envelope steps, at most 'run'
+static inline uint32_t fds_env_due(struct fds_s* fds, struct fdsenv_s* env, uint32_t run)
+{
+    uint32_t left;
+
+    if(env->disabled)
+        return run;
+
+    left = 8 * (env->speed + 1) * fds->envspeed - env->timer;
+    return (left < run) ? left : run;
+}
+
+// returns 1 if the gain changed
+static inline int fds_env_run(struct fds_s* fds, struct fdsenv_s* env, uint32_t run)
+{
+    if(env->disabled)
+        return 0;
+
+    env->timer += run;
+    if(env->timer < 8 * (env->speed + 1) * fds->envspeed)
+        return 0;
+
+    env->timer = 0;
+    if(env->increase)
+    {
+        if(env->gain >= 32)
+            return 0;
+        ++env->gain;
+    }
+    else
+    {
+        if(env->gain == 0)
+            return 0;
+        --env->gain;
+    }
+
+    return 1;
+}
+
+// runs from one modulation or envelope step to the next, the wave only
+// moves on by pitch*cycles in between
+static void fds_process(void* chip, uint32_t cycles)
+{
+    struct fds_s* fds = chip;
+    int envelopes = !fds->envhalt && !fds->wavehalt && fds->envspeed;
+    int modulating = !fds->modhalt && fds->modfreq;
+    uint32_t run, left, acc;
+    uint64_t waveacc;
+
+    while(cycles > 0)
+    {
+        run = cycles;
+
+        if(modulating)
+        {
+            left = (0x10000 - (fds->modacc&0xFFFF) + fds->modfreq - 1) / fds->modfreq;
+            if(left < run)
+                run = left;
+        }
+
+        if(envelopes)
+        {
+            run = fds_env_due(fds, &fds->vol, run);
+            run = fds_env_due(fds, &fds->mod, run);
+        }
+
+        if(!fds->wavehalt)
+        {
+            waveacc = fds->waveacc + (uint64_t)fds->pitch*run;
+            if(waveacc > FDS_PHASE_MASK)
+                fds->volout = (fds->vol.gain < 32) ? fds->vol.gain : 32;
+            fds->waveacc = waveacc & FDS_PHASE_MASK;
+        }
+        else
+            fds->volout = (fds->vol.gain < 32) ? fds->vol.gain : 32;
+
+        if(modulating)
+        {
+            // at most one step, run ends on it
+            acc = fds->modacc + fds->modfreq*run;
+            if((acc>>16) != (fds->modacc>>16))
+            {
+                byte step = fds->modtable[(fds->modacc>>16)&0x3F];
+
+                if(step == 4)
+                    fds->counter = 0;
+                else
+                    fds->counter = (fds->counter + fds_modsteps[step]) & 0x7F;
+                fds_modulate(fds);
+            }
+            fds->modacc = acc & FDS_PHASE_MASK;
+        }
+
+        if(envelopes)
+        {
+            fds_env_run(fds, &fds->vol, run);
+            if(fds_env_run(fds, &fds->mod, run))
+                fds_modulate(fds);
+        }
+
+        cycles -= run;
+    }
+}
+
+static int32_t fds_output(void* chip)
+{
+    struct fds_s* fds = chip;
+
+    if(!fds->wavewrite)
+        fds->sample = fds->wave[fds->waveacc>>16];
+
+    return fds->sample * fds->volout * fds_master[fds->master] * FDS_LEVEL;
+}
+
+const apumapper_t fds_mapper =
+{
+    "FDS",
+    fds_init,
+    fds_cleanup,
+    fds_reset,
+    fds_write,
+    fds_read,
+    FDS_WAVE,
+    FDS_MODGAIN,
+    fds_process,
+    fds_output,
+    NULL,
+    NULL,       // one channel
+    NULL,
+};
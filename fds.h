@@ -0,0 +1,12 @@
+#ifndef FDS_H_INCLUDED
+#define FDS_H_INCLUDED
+
+#include "apu.h"
+
+// Famicom Disk System: one channel playing a 64 step wavetable, its pitch
+// bent by a second 64 step table of modulation steps, with volume and
+// modulation depth envelopes. $4040-$407F is the wave, $4080-$408A the
+// registers and $4090/$4092 read back the envelope gains.
+extern const apumapper_t fds_mapper;
+
+#endif // FDS_H_INCLUDED
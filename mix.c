@@ -0,0 +1,323 @@
+#include "mix.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIX_X86
+#include <immintrin.h>
+#endif
+
+#define MIX_OFFSET  0x7fffffffU
+#define MIX_FSCALE  (1.0f/((float)MIX_UNITY*2147483648.0f))
+
+typedef void (*mixs16_t)(const struct mixin_s* in, int16_t* out, int n);
+typedef void (*mixf32_t)(const struct mixin_s* in, float* out, int n);
+
+static int mix_impl;
+static mixs16_t mix_s16_impl;
+static mixf32_t mix_f32_impl;
+static pthread_once_t mix_once = PTHREAD_ONCE_INIT;
+
+// mixed sample 'i' before gain
+static inline int32_t mix_sample(const struct mixin_s* in, int i)
+{
+    byte tri = in->tri[i];
+
+    return (int32_t)(in->pulse_lut[in->pulse1[i] + in->pulse2[i]]
+                   + in->tnd_lut[(tri + (tri<<1)) + (in->noise[i]<<1) + in->dmc[i]] - MIX_OFFSET);
+}
+
+// top 16 bits of sample 'i' with the expansion chips, before gain
+static inline int32_t mix_sample16(const struct mixin_s* in, int i)
+{
+    int32_t v = mix_sample(in, i)>>16;
+
+    if(in->ext)
+    {
+        v += in->ext[i]>>16;
+
+        if(v > 32767) v = 32767;
+        else
+        if(v < -32768) v = -32768;
+    }
+
+    return v;
+}
+
+// samples 'i' to 'n', also finishing what the vector versions leave over
+static void mix_s16_range(const struct mixin_s* in, int16_t* out, int i, int n)
+{
+    int32_t v;
+
+    for(; i < n; ++i)
+    {
+        v = (mix_sample16(in, i) * in->gain)>>8;
+
+        if(v > 32767) v = 32767;
+        else
+        if(v < -32768) v = -32768;
+
+        out[i] = v;
+    }
+}
+
+static void mix_f32_range(const struct mixin_s* in, float* out, int i, int n)
+{
+    float scale = in->gain * MIX_FSCALE;
+    float v;
+
+    for(; i < n; ++i)
+    {
+        v = (float)mix_sample(in, i);
+        if(in->ext)
+            v += (float)in->ext[i];
+        v *= scale;
+
+        if(v > 1.0f) v = 1.0f;
+        if(v < -1.0f) v = -1.0f;
+
+        out[i] = v;
+    }
+}
+
+static void mix_s16_scalar(const struct mixin_s* in, int16_t* out, int n)
+{
+    mix_s16_range(in, out, 0, n);
+}
+
+static void mix_f32_scalar(const struct mixin_s* in, float* out, int n)
+{
+    mix_f32_range(in, out, 0, n);
+}
+
+#ifdef MIX_X86
+
+// SSE2 has no gathers, so the table lookups stay scalar and only the
+// scaling, clipping and conversion run four samples wide
+__attribute__((target("sse2")))
+static inline __m128i mix_sse2_sample4(const struct mixin_s* in, int i)
+{
+    return _mm_set_epi32(mix_sample(in, i+3), mix_sample(in, i+2), mix_sample(in, i+1), mix_sample(in, i));
+}
+
+__attribute__((target("sse2")))
+static void mix_s16_sse2(const struct mixin_s* in, int16_t* out, int n)
+{
+    __m128i gain = _mm_set1_epi16(in->gain);
+    __m128i a, b, x, lo, hi;
+    int i;
+
+    for(i = 0; i+8 <= n; i += 8)
+    {
+        a = _mm_srai_epi32(mix_sse2_sample4(in, i), 16);
+        b = _mm_srai_epi32(mix_sse2_sample4(in, i+4), 16);
+
+        if(in->ext)
+        {
+            a = _mm_add_epi32(a, _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(in->ext+i)), 16));
+            b = _mm_add_epi32(b, _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(in->ext+i+4)), 16));
+        }
+
+        // the top 16 bits of the APU alone always fit, the pack only clips
+        // what the expansion chips add
+        x = _mm_packs_epi32(a, b);
+
+        // 16x16 bit products widened back to 32 bits, scaled down and
+        // clipped by the saturating pack
+        lo = _mm_mullo_epi16(x, gain);
+        hi = _mm_mulhi_epi16(x, gain);
+        x = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 8),
+                            _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 8));
+
+        _mm_storeu_si128((__m128i*)(out+i), x);
+    }
+
+    mix_s16_range(in, out, i, n);
+}
+
+__attribute__((target("sse2")))
+static void mix_f32_sse2(const struct mixin_s* in, float* out, int n)
+{
+    __m128 scale = _mm_set1_ps(in->gain * MIX_FSCALE);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 minusone = _mm_set1_ps(-1.0f);
+    __m128 v;
+    int i;
+
+    for(i = 0; i+4 <= n; i += 4)
+    {
+        v = _mm_cvtepi32_ps(mix_sse2_sample4(in, i));
+        if(in->ext)
+            v = _mm_add_ps(v, _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(in->ext+i))));
+        v = _mm_mul_ps(v, scale);
+        v = _mm_max_ps(_mm_min_ps(v, one), minusone);
+        _mm_storeu_ps(out+i, v);
+    }
+
+    mix_f32_range(in, out, i, n);
+}
+
+// eight samples straight from the level streams: widen the levels, build
+// both table indices and gather
+__attribute__((target("avx2")))
+static inline __m256i mix_avx2_sample8(const struct mixin_s* in, int i)
+{
+    __m256i pulse1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in->pulse1+i)));
+    __m256i pulse2 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in->pulse2+i)));
+    __m256i tri = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in->tri+i)));
+    __m256i noise = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in->noise+i)));
+    __m256i dmc = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in->dmc+i)));
+    __m256i pulse, tnd;
+
+    pulse = _mm256_add_epi32(pulse1, pulse2);
+    tnd = _mm256_add_epi32(_mm256_add_epi32(tri, _mm256_slli_epi32(tri, 1)),
+                           _mm256_add_epi32(_mm256_slli_epi32(noise, 1), dmc));
+
+    pulse = _mm256_i32gather_epi32((const int*)in->pulse_lut, pulse, 4);
+    tnd = _mm256_i32gather_epi32((const int*)in->tnd_lut, tnd, 4);
+
+    return _mm256_sub_epi32(_mm256_add_epi32(pulse, tnd), _mm256_set1_epi32(MIX_OFFSET));
+}
+
+__attribute__((target("avx2")))
+static void mix_s16_avx2(const struct mixin_s* in, int16_t* out, int n)
+{
+    __m256i gain = _mm256_set1_epi32(in->gain);
+    __m256i max = _mm256_set1_epi32(32767);
+    __m256i min = _mm256_set1_epi32(-32768);
+    __m256i a, b;
+    int i;
+
+    for(i = 0; i+16 <= n; i += 16)
+    {
+        a = _mm256_srai_epi32(mix_avx2_sample8(in, i), 16);
+        b = _mm256_srai_epi32(mix_avx2_sample8(in, i+8), 16);
+
+        if(in->ext)
+        {
+            a = _mm256_add_epi32(a, _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*)(in->ext+i)), 16));
+            b = _mm256_add_epi32(b, _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*)(in->ext+i+8)), 16));
+            a = _mm256_max_epi32(_mm256_min_epi32(a, max), min);
+            b = _mm256_max_epi32(_mm256_min_epi32(b, max), min);
+        }
+
+        a = _mm256_srai_epi32(_mm256_mullo_epi32(a, gain), 8);
+        b = _mm256_srai_epi32(_mm256_mullo_epi32(b, gain), 8);
+
+        // the pack clips, and interleaves the 128 bit halves of a and b
+        a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out+i), a);
+    }
+
+    mix_s16_range(in, out, i, n);
+}
+
+__attribute__((target("avx2")))
+static void mix_f32_avx2(const struct mixin_s* in, float* out, int n)
+{
+    __m256 scale = _mm256_set1_ps(in->gain * MIX_FSCALE);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 minusone = _mm256_set1_ps(-1.0f);
+    __m256 v;
+    int i;
+
+    for(i = 0; i+8 <= n; i += 8)
+    {
+        v = _mm256_cvtepi32_ps(mix_avx2_sample8(in, i));
+        if(in->ext)
+            v = _mm256_add_ps(v, _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(in->ext+i))));
+        v = _mm256_mul_ps(v, scale);
+        v = _mm256_max_ps(_mm256_min_ps(v, one), minusone);
+        _mm256_storeu_ps(out+i, v);
+    }
+
+    mix_f32_range(in, out, i, n);
+}
+
+#endif // MIX_X86
+
+// the best implementation this CPU runs
+int mix_detect(void)
+{
+#ifdef MIX_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return MIX_AVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return MIX_SSE2;
+#endif
+    return MIX_SCALAR;
+}
+
+static void mix_select(int impl)
+{
+    switch(impl)
+    {
+#ifdef MIX_X86
+        case MIX_AVX2:
+            mix_s16_impl = mix_s16_avx2;
+            mix_f32_impl = mix_f32_avx2;
+            break;
+        case MIX_SSE2:
+            mix_s16_impl = mix_s16_sse2;
+            mix_f32_impl = mix_f32_sse2;
+            break;
+#endif
+        default:
+            impl = MIX_SCALAR;
+            mix_s16_impl = mix_s16_scalar;
+            mix_f32_impl = mix_f32_scalar;
+            break;
+    }
+
+    mix_impl = impl;
+}
+
+static void mix_init(void)
+{
+    mix_select(mix_detect());
+}
+
+// force an implementation, for comparing them. anything the CPU does not
+// support falls back to the best one it does. not safe to call while
+// another thread is mixing. returns the one selected.
+int mix_setimpl(int impl)
+{
+    int best;
+
+    pthread_once(&mix_once, mix_init);
+
+    best = mix_detect();
+    if(impl > best)
+        impl = best;
+
+    mix_select(impl);
+    return mix_impl;
+}
+
+int mix_getimpl(void)
+{
+    pthread_once(&mix_once, mix_init);
+    return mix_impl;
+}
+
+const char* mix_implname(int impl)
+{
+    switch(impl)
+    {
+        case MIX_SSE2:  return "sse2";
+        case MIX_AVX2:  return "avx2";
+    }
+    return "scalar";
+}
+
+void mix_s16(const struct mixin_s* in, int16_t* out, int n)
+{
+    pthread_once(&mix_once, mix_init);
+    mix_s16_impl(in, out, n);
+}
+
+void mix_f32(const struct mixin_s* in, float* out, int n)
+{
+    pthread_once(&mix_once, mix_init);
+    mix_f32_impl(in, out, n);
+}
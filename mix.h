@@ -0,0 +1,44 @@
+#ifndef MIX_H_INCLUDED
+#define MIX_H_INCLUDED
+
+#include "M6502/M6502.h"
+#include <stdint.h>
+
+// Non-linear mix of blocks of APU channel levels. Each output sample is
+//
+//   pulse_lut[pulse1+pulse2] + tnd_lut[3*tri + 2*noise + dmc] - 0x7fffffff
+//
+// taken modulo 2^32 as a signed 32 bit sample, then scaled by 'gain' and
+// clipped. With expansion chips their level is added too: to the top 16
+// bits, clipped, for 16 bit output, and in full for float output. The
+// vector versions give the same results as the scalar one and are picked
+// at run time by what the CPU supports.
+
+#define MIX_SCALAR  0
+#define MIX_SSE2    1
+#define MIX_AVX2    2
+
+#define MIX_UNITY   256     // gain of 1.0, gains are 8 bit fixed point
+
+struct mixin_s
+{
+    const uint32_t* pulse_lut;  // 31 entries
+    const uint32_t* tnd_lut;    // 203 entries
+    const byte* pulse1;         // one level per sample for each channel
+    const byte* pulse2;
+    const byte* tri;
+    const byte* noise;
+    const byte* dmc;
+    const int32_t* ext;         // expansion chip level per sample, NULL if none
+    int32_t gain;               // MIX_UNITY based, at most 16*MIX_UNITY
+};
+
+int mix_detect(void);
+int mix_setimpl(int impl);
+int mix_getimpl(void);
+const char* mix_implname(int impl);
+
+void mix_s16(const struct mixin_s* in, int16_t* out, int n);
+void mix_f32(const struct mixin_s* in, float* out, int n);
+
+#endif // MIX_H_INCLUDED
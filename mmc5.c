@@ -0,0 +1,229 @@
+#include "mmc5.h"
+#include "square.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MMC5_PULSE1     0x5000
+#define MMC5_PULSE2     0x5004
+#define MMC5_PCMMODE    0x5010
+#define MMC5_PCM        0x5011
+#define MMC5_STATUS     0x5015
+
+// a full volume pulse is as loud as a full 2A03 one, the full PCM range
+// about as loud as the DMC's
+#define MMC5_LEVEL      (650<<16)
+#define MMC5_PCM_LEVEL  (26<<16)
+
+struct mmc5pulse_s
+{
+    struct square_s timer;  // the low 3 bits of its step are the duty phase
+    byte duty;
+    byte enabled;
+    byte length;            // length counter, silent at 0
+    word period;            // 11 bit, the timer steps every 2*(period+1) cycles
+
+    byte loop_halt;         // envelope loops, length counter halted
+    byte const_vol;
+    byte volperiod;
+    byte start;
+    byte divider;
+    byte counter;
+};
+
+struct mmc5_s
+{
+    struct mmc5pulse_s pulse[2];
+    struct square_s frame;  // steps at 240Hz
+    byte pcmread;           // $5010 bit 0, PCM from reads is not emulated
+    byte pcm;
+};
+
+static void* mmc5_init(uint32_t cpu_clock)
+{
+    struct mmc5_s* mmc5 = calloc(1, sizeof(struct mmc5_s));
+
+    if(mmc5)
+        mmc5->frame.period = cpu_clock / 240;
+
+    return mmc5;
+}
+
+static void mmc5_cleanup(void* chip)
+{
+    free(chip);
+}
+
+static void mmc5_reset(void* chip)
+{
+    struct mmc5_s* mmc5 = chip;
+    uint32_t frame = mmc5->frame.period;
+    int i;
+
+    memset(mmc5, 0, sizeof(struct mmc5_s));
+    square_reset(&mmc5->frame, frame);
+    for(i = 0; i < 2; ++i)
+        square_reset(&mmc5->pulse[i].timer, 2);
+}
+
+static void mmc5_pulse_write(struct mmc5pulse_s* p, byte reg, byte data)
+{
+    switch(reg)
+    {
+        case 0:
+            p->duty = data>>6;
+            p->loop_halt = BIT(data, 5);
+            p->const_vol = BIT(data, 4);
+            p->volperiod = data&0x0F;
+            break;
+        case 2:
+            p->period = (p->period&0x700) | data;
+            square_setperiod(&p->timer, 2*(p->period+1));
+            break;
+        case 3:
+            p->period = (p->period&0x0FF) | ((data&0x07)<<8);
+            square_setperiod(&p->timer, 2*(p->period+1));
+            p->timer.step = 0;
+            p->start = 1;
+            if(p->enabled)
+                p->length = length_lut[data>>3];
+            break;
+    }
+}
+
+static int mmc5_write(void* chip, word addr, byte data)
+{
+    struct mmc5_s* mmc5 = chip;
+    int i;
+
+    switch(addr)
+    {
+        case MMC5_PULSE1:
+        case MMC5_PULSE1+1:
+        case MMC5_PULSE1+2:
+        case MMC5_PULSE1+3:
+            mmc5_pulse_write(&mmc5->pulse[0], addr&3, data);
+            return 1;
+        case MMC5_PULSE2:
+        case MMC5_PULSE2+1:
+        case MMC5_PULSE2+2:
+        case MMC5_PULSE2+3:
+            mmc5_pulse_write(&mmc5->pulse[1], addr&3, data);
+            return 1;
+        case MMC5_PCMMODE:
+            mmc5->pcmread = BIT(data, 0);
+            return 1;
+        case MMC5_PCM:
+            // 0 is ignored, it ends sample playback on the chip
+            if(!mmc5->pcmread && data)
+                mmc5->pcm = data;
+            return 1;
+        case MMC5_STATUS:
+            for(i = 0; i < 2; ++i)
+            {
+                mmc5->pulse[i].enabled = BIT(data, i);
+                if(!mmc5->pulse[i].enabled)
+                    mmc5->pulse[i].length = 0;
+            }
+            return 1;
+    }
+
+    return 0;
+}
+
+static int mmc5_read(void* chip, word addr)
+{
+    struct mmc5_s* mmc5 = chip;
+
+    if(addr == MMC5_STATUS)
+        return ((mmc5->pulse[1].length>0)<<1) | (mmc5->pulse[0].length>0);
+
+    return -1;
+}
+
+// one step of the 240Hz sequencer, envelopes and length counters together
+static void mmc5_frame(struct mmc5pulse_s* p)
+{
+    if(p->start)
+    {
+        p->start = 0;
+        p->counter = 15;
+        p->divider = p->volperiod;
+    }
+    else
+    if(p->divider)
+        --p->divider;
+    else
+    {
+        p->divider = p->volperiod;
+        if(p->counter)
+            --p->counter;
+        else
+        if(p->loop_halt)
+            p->counter = 15;
+    }
+
+    if(p->length && !p->loop_halt)
+        --p->length;
+}
+
+static void mmc5_process(void* chip, uint32_t cycles)
+{
+    struct mmc5_s* mmc5 = chip;
+    uint32_t frames;
+
+    for(frames = square_run(&mmc5->frame, cycles); frames > 0; --frames)
+    {
+        mmc5_frame(&mmc5->pulse[0]);
+        mmc5_frame(&mmc5->pulse[1]);
+    }
+
+    square_run(&mmc5->pulse[0].timer, cycles);
+    square_run(&mmc5->pulse[1].timer, cycles);
+}
+
+static inline int32_t mmc5_pulse_level(const struct mmc5pulse_s* p)
+{
+    if(!p->length || !pulseseq[p->duty][-p->timer.step & 7])
+        return 0;
+
+    return p->const_vol ? p->volperiod : p->counter;
+}
+
+static int32_t mmc5_output(void* chip)
+{
+    struct mmc5_s* mmc5 = chip;
+
+    return (mmc5_pulse_level(&mmc5->pulse[0]) + mmc5_pulse_level(&mmc5->pulse[1])) * MMC5_LEVEL +
+           mmc5->pcm * MMC5_PCM_LEVEL;
+}
+
+static const char* const mmc5_stemnames[] =
+{
+    "MMC5 pulse1", "MMC5 pulse2", "MMC5 pcm", NULL
+};
+
+static void mmc5_stems(void* chip, int32_t* levels)
+{
+    struct mmc5_s* mmc5 = chip;
+
+    levels[0] = mmc5_pulse_level(&mmc5->pulse[0]) * MMC5_LEVEL;
+    levels[1] = mmc5_pulse_level(&mmc5->pulse[1]) * MMC5_LEVEL;
+    levels[2] = mmc5->pcm * MMC5_PCM_LEVEL;
+}
+
+const apumapper_t mmc5_mapper =
+{
+    "MMC5",
+    mmc5_init,
+    mmc5_cleanup,
+    mmc5_reset,
+    mmc5_write,
+    mmc5_read,
+    MMC5_STATUS,
+    MMC5_STATUS,
+    mmc5_process,
+    mmc5_output,
+    NULL,
+    mmc5_stemnames,
+    mmc5_stems,
+};
@@ -0,0 +1,12 @@
+#ifndef MMC5_H_INCLUDED
+#define MMC5_H_INCLUDED
+
+#include "apu.h"
+
+// Nintendo MMC5: two pulse channels like the 2A03 ones without the sweep,
+// at $5000-$5007 and enabled through $5015, and an 8 bit PCM channel
+// written at $5011. Their envelopes and length counters run at a fixed
+// 240Hz instead of off the frame counter.
+extern const apumapper_t mmc5_mapper;
+
+#endif // MMC5_H_INCLUDED
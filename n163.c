@@ -0,0 +1,261 @@
+#include "n163.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define N163_DATA       0x4800  // $4800-$4FFF
+#define N163_ADDR       0xF800  // $F800-$FFFF
+
+#define N163_SLOT       15      // CPU cycles per channel update
+#define N163_REGS       0x40    // channel registers, 8 bytes each, up to $7F
+
+// one step of a channel's sample*volume, 0-225. the chip only outputs one
+// channel at a time, so this is also the step of the whole mix.
+#define N163_LEVEL      (1<<23)
+
+struct n163_s
+{
+    byte ram[0x80];
+    byte addr;
+    byte autoinc;
+
+    int mode;               // APU_N163_*
+    byte current;           // channel being output, 7 down to 8-channels
+    uint32_t slotleft;      // cycles until the next one
+    int32_t out[8];         // sample*volume of every channel's last update
+
+    // APU_N163_MULTIPLEX: output summed over every cycle since the last
+    // sample, so that the multiplexing averages out instead of aliasing
+    int64_t sum;
+    uint32_t sumcycles;
+};
+
+static inline int n163_channels(struct n163_s* n163)
+{
+    return ((n163->ram[0x7F]>>4)&0x07) + 1;
+}
+
+// move channel 'ch' on by 'steps' updates and take its new sample
+static void n163_update(struct n163_s* n163, int ch, uint32_t steps)
+{
+    byte* regs = &n163->ram[N163_REGS + ch*8];
+    uint32_t freq, length;
+    uint64_t phase;
+    byte index, sample;
+
+    freq = regs[0] | (regs[2]<<8) | ((regs[4]&0x03)<<16);
+    phase = regs[1] | (regs[3]<<8) | (regs[5]<<16);
+    length = (256 - (regs[4]&0xFC))<<16;
+
+    phase = (phase + (uint64_t)freq*steps) % length;
+
+    regs[1] = phase;
+    regs[3] = phase>>8;
+    regs[5] = phase>>16;
+
+    // 4 bit samples, low nibble first
+    index = (phase>>16) + regs[6];
+    sample = (n163->ram[index>>1] >> ((index&1)<<2)) & 0x0F;
+
+    n163->out[ch] = sample * (regs[7]&0x0F);
+}
+
+static void* n163_init(uint32_t cpu_clock)
+{
+    return calloc(1, sizeof(struct n163_s));
+}
+
+static void n163_cleanup(void* chip)
+{
+    free(chip);
+}
+
+static void n163_reset(void* chip)
+{
+    struct n163_s* n163 = chip;
+    int mode = n163->mode;
+
+    memset(n163, 0, sizeof(struct n163_s));
+    n163->mode = mode;
+    n163->current = 7;
+    n163->slotleft = N163_SLOT*n163_channels(n163);     // a full round
+}
+
+static void n163_option(void* chip, int option, int value)
+{
+    struct n163_s* n163 = chip;
+
+    if(option == APU_OPT_N163_MIX)
+    {
+        n163->mode = value;
+        n163->sum = 0;
+        n163->sumcycles = 0;
+    }
+}
+
+static int n163_write(void* chip, word addr, byte data)
+{
+    struct n163_s* n163 = chip;
+
+    if(addr >= N163_ADDR)
+    {
+        n163->addr = data&0x7F;
+        n163->autoinc = BIT(data, 7);
+        return 1;
+    }
+
+    if((addr&0xF800) == N163_DATA)
+    {
+        n163->ram[n163->addr] = data;
+        if(n163->autoinc)
+            n163->addr = (n163->addr+1)&0x7F;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int n163_read(void* chip, word addr)
+{
+    struct n163_s* n163 = chip;
+    byte data;
+
+    if((addr&0xF800) != N163_DATA)
+        return -1;
+
+    data = n163->ram[n163->addr];
+    if(n163->autoinc)
+        n163->addr = (n163->addr+1)&0x7F;
+
+    return data;
+}
+
+// every channel gets one update per round of 15*channels cycles. which
+// channel is due next is not tracked, the slot counter only keeps the
+// rounds exact.
+static void n163_process_average(struct n163_s* n163, uint32_t cycles)
+{
+    int channels = n163_channels(n163);
+    uint32_t round = N163_SLOT*channels;
+    uint32_t rounds;
+    int ch;
+
+    // the slot counter may still be from a longer round, before $7F
+    // lowered the channel count
+    if(n163->slotleft > round)
+        n163->slotleft = round;
+
+    cycles += round - n163->slotleft;
+    rounds = cycles / round;
+    n163->slotleft = round - cycles % round;
+
+    if(!rounds)
+        return;
+
+    for(ch = 8-channels; ch < 8; ++ch)
+        n163_update(n163, ch, rounds);
+}
+
+// the channels take turns, each on the output until the next one is updated
+static void n163_process_multiplex(struct n163_s* n163, uint32_t cycles)
+{
+    int first = 8 - n163_channels(n163);
+    uint32_t run;
+
+    // the slot counter may still be from APU_N163_AVERAGE
+    if(n163->slotleft > N163_SLOT)
+        n163->slotleft = N163_SLOT;
+
+    while(cycles > 0)
+    {
+        run = (cycles < n163->slotleft) ? cycles : n163->slotleft;
+
+        n163->sum += (int64_t)n163->out[n163->current] * run;
+        n163->sumcycles += run;
+        n163->slotleft -= run;
+        cycles -= run;
+
+        if(n163->slotleft == 0)
+        {
+            if(n163->current <= first)
+                n163->current = 7;
+            else
+                --n163->current;
+
+            n163_update(n163, n163->current, 1);
+            n163->slotleft = N163_SLOT;
+        }
+    }
+}
+
+static void n163_process(void* chip, uint32_t cycles)
+{
+    struct n163_s* n163 = chip;
+
+    if(n163->mode == APU_N163_AVERAGE)
+        n163_process_average(n163, cycles);
+    else
+        n163_process_multiplex(n163, cycles);
+}
+
+static int32_t n163_output(void* chip)
+{
+    struct n163_s* n163 = chip;
+    int32_t level;
+    int channels, ch;
+
+    if(n163->mode == APU_N163_AVERAGE)
+    {
+        channels = n163_channels(n163);
+
+        level = 0;
+        for(ch = 8-channels; ch < 8; ++ch)
+            level += n163->out[ch];
+
+        return level * (N163_LEVEL / channels);
+    }
+
+    if(!n163->sumcycles)
+        return n163->out[n163->current] * N163_LEVEL;
+
+    level = (int32_t)(n163->sum / n163->sumcycles);
+    n163->sum = 0;
+    n163->sumcycles = 0;
+
+    return level * N163_LEVEL;
+}
+
+// channel 1 has the registers at the top of the RAM
+static const char* const n163_stemnames[] =
+{
+    "N163 ch1", "N163 ch2", "N163 ch3", "N163 ch4",
+    "N163 ch5", "N163 ch6", "N163 ch7", "N163 ch8", NULL
+};
+
+// a channel is on the output for 1/channels of the time when they take
+// turns, so either way its stem is its share of the average mix
+static void n163_stems(void* chip, int32_t* levels)
+{
+    struct n163_s* n163 = chip;
+    int channels = n163_channels(n163);
+    int i;
+
+    for(i = 0; i < 8; ++i)
+        levels[i] = (i < channels) ? n163->out[7-i] * (N163_LEVEL / channels) : 0;
+}
+
+const apumapper_t n163_mapper =
+{
+    "Namco 163",
+    n163_init,
+    n163_cleanup,
+    n163_reset,
+    n163_write,
+    n163_read,
+    N163_DATA,
+    N163_DATA+0x7FF,
+    n163_process,
+    n163_output,
+    n163_option,
+    n163_stemnames,
+    n163_stems,
+};
@@ -0,0 +1,13 @@
+#ifndef N163_H_INCLUDED
+#define N163_H_INCLUDED
+
+#include "apu.h"
+
+// Namco 163: up to 8 wavetable channels in 128 bytes of internal RAM,
+// reached through the address port at $F800 and the data port at $4800.
+// The chip updates one channel every 15 CPU cycles and outputs only that
+// one in the meantime; APU_OPT_N163_MIX picks whether that is emulated or
+// the channels are simply mixed.
+extern const apumapper_t n163_mapper;
+
+#endif // N163_H_INCLUDED
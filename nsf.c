@@ -0,0 +1,826 @@
+#include "nsf.h"
+#include "apu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct nsf_s
+{
+    struct nsfhead_s head;
+    byte use_bankswitching;
+    float playfreq;
+
+    // the whole NSF payload, preceded by the load address padding and rounded
+    // up to whole 4KiB banks, so that bank n starts at image + n*0x1000
+    byte* image;
+    word banks;
+
+    // $8000-$FFFF as eight 4KiB pages pointing into image
+    const byte* pages[8];
+    byte bankswitch[8];
+
+    M6502 cpu;
+    byte wram[0x800];
+    byte sram[0x2000];
+
+    // FDS tunes have RAM at $6000-$DFFF in place of sram, NULL otherwise.
+    // banks are copied into it by nsf_init() and by bank switches, and
+    // pages[0-5] point into it.
+    byte* fdsram;
+
+    // MMC5 tunes may use its ExRAM at $5C00-$5FF5 and its 8x8 multiplier at
+    // $5205/$5206. those are mapper memory rather than sound, so they are
+    // here and not behind the timed APU writes.
+    byte exram[0x400];
+    byte multiplier[2];
+
+    struct apu_s* apu;
+
+    int samplerate;
+    byte synthesis;         // APU_SYNTH_*
+    float gain;
+    int options[APU_OPTIONS];   // apu_setoption() values for every nsf_init()
+    int samplesPerPlay;     // rounded down, for sizing buffers
+
+    // play calls are scheduled on the CPU clock of the APU, in millionths
+    // of a cycle so that any play speed adds up exactly
+    uint64_t playPeriod;
+    uint64_t playNext;
+
+    byte call_returned;
+    int call_icount;        // cycles left in the batch when the routine returned
+    byte call_timed;        // writes of the running routine are timestamped
+    uint64_t call_start;    // CPU cycle the running routine started at
+    int call_done;          // cycles it ran in earlier Exec6502() batches
+
+    int profiling;          // time the routines and the APU separately
+    struct nsfprofile_s profile;
+
+#ifdef NSF_STATS
+    struct nsfstats_s stats;
+    int song;               // 0 based, -1 before the first nsf_init()
+    int call_instructions;  // of the last Call6502()
+    int call_cycles;
+#endif
+};
+
+// Call6502 pushes $0000 as the return address, so the final RTS of the
+// called routine continues at CALL_RETURN.
+#define CALL_RETURN 0x0001
+#ifdef NSF_STATS
+#define CALL_SLICE  1           // one instruction per batch, so they can be counted
+#else
+#define CALL_SLICE  0x10000     // cycles given to each Exec6502() batch
+#endif
+
+static const byte cart_empty[0x1000];  // mapped for banks past the end of the image
+
+// the instance the 6502 core is currently running on this thread. the core
+// calls Rd6502/Wr6502/Op6502 without any context, so every entry point that
+// may end up in the core sets this first.
+static __thread struct nsf_s* nsfctx;
+
+static int load_nsf_image(struct nsf_s* nsf, FILE *file)
+{
+    long size;
+    word padding;
+
+    if(fseek(file, 0, SEEK_END) != 0)
+        return 0;
+
+    size = ftell(file) - (long)sizeof(struct nsfhead_s);
+    if(size <= 0)
+        return 0;
+
+    if(nsf->use_bankswitching == 1)
+        padding = nsf->head.load & 0xfff;
+    else
+    if(BIT(nsf->head.extsnd, 2))
+        padding = nsf->head.load - 0x6000;  // FDS, banks 0-9 at $6000-$FFFF
+    else
+        padding = nsf->head.load - 0x8000;
+
+    nsf->banks = (padding + size + 0xfff)>>12;
+    if(nsf->banks > 0x100)
+        nsf->banks = 0x100;   // bank numbers are only 8 bits wide
+
+    if((long)(nsf->banks<<12) - padding < size)
+        size = (nsf->banks<<12) - padding;
+
+    nsf->image = calloc(nsf->banks, 0x1000);
+    if(!nsf->image)
+        return 0;
+
+    fseek(file, sizeof(struct nsfhead_s), SEEK_SET);
+    if(fread(nsf->image+padding, 1, size, file) < (size_t)size)
+    {
+        free(nsf->image);
+        nsf->image = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+static const byte* cart_bank(struct nsf_s* nsf, byte bank)
+{
+    if(bank < nsf->banks)
+        return nsf->image + (bank<<12);
+
+    return cart_empty;
+}
+
+// map one of the 4KiB banks of the image into $8000-$FFFF, 'page' 0-7
+static void cart_switch(struct nsf_s* nsf, byte page, byte bank)
+{
+    nsf->bankswitch[page] = bank;
+    nsf->pages[page] = cart_bank(nsf, bank);
+}
+
+// the same for FDS tunes, 'slot' 0-9 is $6000-$FFFF. $6000-$DFFF is RAM, so
+// a bank switched in there is copied and may then be written to.
+static void cart_fdsswitch(struct nsf_s* nsf, byte slot, byte bank)
+{
+    byte* ram = nsf->fdsram + (slot<<12);
+
+    if(slot < 8)
+        memcpy(ram, cart_bank(nsf, bank), 0x1000);
+
+    if(slot < 2)
+        return;
+
+    nsf->bankswitch[slot-2] = bank;
+    nsf->pages[slot-2] = (slot < 8) ? ram : cart_bank(nsf, bank);
+}
+
+#define NSF_SPEED_NTSC  16639   // 1/1000000th second ticks of the usual rates,
+#define NSF_SPEED_PAL   19997   // for tunes that leave theirs at 0
+
+// play period in 1/1000000th second ticks
+static word nsf_playspeed(struct nsf_s* nsf)
+{
+    if(nsf->head.palntsc&3)
+        return nsf->head.speedpal ? nsf->head.speedpal : NSF_SPEED_PAL;
+
+    return nsf->head.speedntsc ? nsf->head.speedntsc : NSF_SPEED_NTSC;
+}
+
+struct nsf_s* nsf_open(const char* filename, int samplerate, int* error)
+{
+    struct nsf_s* nsf;
+    FILE* file;
+    int err = NSF_OK;
+    int i;
+
+    nsf = calloc(1, sizeof(struct nsf_s));
+    if(!nsf)
+    {
+        if(error) *error = NSF_ERR_MEMORY;
+        return NULL;
+    }
+
+    nsf->samplerate = samplerate;
+    nsf->gain = 1.0f;
+    STAT(nsf->song = -1;)
+
+    file = fopen(filename, "rb");
+    if(!file)
+    {
+        free(nsf);
+        if(error) *error = NSF_ERR_OPEN;
+        return NULL;
+    }
+
+    if(fread(&nsf->head, 1, sizeof(struct nsfhead_s), file) < sizeof(struct nsfhead_s))
+        err = NSF_ERR_SHORT;
+    else
+    if(memcmp(nsf->head.id, "NESM\x1A", 5) != 0)
+        err = NSF_ERR_ID;
+    else
+    if(nsf->head.version != 1)
+        err = NSF_ERR_VERSION;
+    else
+    if( (nsf->head.songs == 0) || (nsf->head.start == 0) )
+        err = NSF_ERR_NOSONGS;
+
+    if(err == NSF_OK)
+    {
+        nsf->use_bankswitching = 0;
+        for(i = 0; i < 8; ++i)
+        {
+            if(nsf->head.bankswitch[i] != 0)
+            {
+                nsf->use_bankswitching = 1;
+                break;
+            }
+        }
+
+        if( (nsf->use_bankswitching == 0) && (nsf->head.load < 0x8000) &&
+            !(BIT(nsf->head.extsnd, 2) && nsf->head.load >= 0x6000) )
+            err = NSF_ERR_LOAD;
+        else
+        if(!load_nsf_image(nsf, file))
+            err = NSF_ERR_READ;
+    }
+
+    if( (err == NSF_OK) && BIT(nsf->head.extsnd, 2) )
+    {
+        nsf->fdsram = malloc(0x8000);
+        if(!nsf->fdsram)
+        {
+            free(nsf->image);
+            err = NSF_ERR_MEMORY;
+        }
+    }
+
+    // everything needed is in memory now
+    fclose(file);
+
+    if(err != NSF_OK)
+    {
+        free(nsf);
+        if(error) *error = err;
+        return NULL;
+    }
+
+    nsf->playfreq = 1000000.0f / nsf_playspeed(nsf);
+
+    nsf->samplesPerPlay = (((float)samplerate)/nsf->playfreq);
+    if(nsf->samplesPerPlay < 1)
+        nsf->samplesPerPlay = 1;
+
+    if(error) *error = NSF_OK;
+    return nsf;
+}
+
+#ifdef NSF_STATS
+static void nsf_endsong(struct nsf_s* nsf);
+#endif
+
+void nsf_close(struct nsf_s* nsf)
+{
+    if(nsf == NULL)
+        return;
+
+    STAT(nsf_endsong(nsf);)
+
+    if(nsf->apu)
+        apu_destroy(nsf->apu);
+
+    free(nsf->fdsram);
+    free(nsf->image);
+    free(nsf);
+}
+
+const char* nsf_strerror(int error)
+{
+    switch(error)
+    {
+        case NSF_OK:            return "no error";
+        case NSF_ERR_OPEN:      return "could not open file";
+        case NSF_ERR_SHORT:     return "invalid file, shorter than NSF header";
+        case NSF_ERR_ID:        return "not a NSF file";
+        case NSF_ERR_VERSION:   return "invalid NSF version";
+        case NSF_ERR_NOSONGS:   return "no songs in NSF";
+        case NSF_ERR_LOAD:      return "load address below $8000";
+        case NSF_ERR_READ:      return "could not read NSF data";
+        case NSF_ERR_MEMORY:    return "out of memory";
+    }
+    return "unknown error";
+}
+
+const struct nsfhead_s* nsf_header(struct nsf_s* nsf)
+{
+    return &nsf->head;
+}
+
+byte nsf_bankswitched(struct nsf_s* nsf)
+{
+    return nsf->use_bankswitching;
+}
+
+float nsf_playfreq(struct nsf_s* nsf)
+{
+    return nsf->playfreq;
+}
+
+int nsf_playsamples(struct nsf_s* nsf)
+{
+    return nsf->samplesPerPlay;
+}
+
+// APU_SYNTH_POINT or APU_SYNTH_BLEP, takes effect on the next nsf_init()
+void nsf_setsynthesis(struct nsf_s* nsf, byte mode)
+{
+    nsf->synthesis = mode;
+}
+
+// output volume, 1.0 is the plain APU mix. takes effect on the next nsf_init()
+void nsf_setgain(struct nsf_s* nsf, float gain)
+{
+    nsf->gain = gain;
+}
+
+// one of the APU_OPT_* expansion chip options, takes effect on the next
+// nsf_init()
+void nsf_setoption(struct nsf_s* nsf, int option, int value)
+{
+    if(option >= 0 && option < APU_OPTIONS)
+        nsf->options[option] = value;
+}
+
+// wall clock timing of nsf_profile(). costs two clock reads per play call
+// and per rendered block, so it is off unless asked for.
+void nsf_setprofiling(struct nsf_s* nsf, int enable)
+{
+    nsf->profiling = enable;
+}
+
+void nsf_profile(struct nsf_s* nsf, struct nsfprofile_s* profile)
+{
+    *profile = nsf->profile;
+    profile->cpu_clock = nsf->apu ? apu_cpuclock(nsf->apu) : 0;
+}
+
+#ifdef NSF_STATS
+void nsf_stats(struct nsf_s* nsf, struct nsfstats_s* stats)
+{
+    *stats = nsf->stats;
+    if(nsf->apu)
+        apu_stats(nsf->apu, &stats->apu);
+    else
+        memset(&stats->apu, 0, sizeof(stats->apu));
+}
+
+void nsf_printstats(struct nsf_s* nsf, FILE* file)
+{
+    static const char* regions[NSF_REGIONS] = { "ram", "io", "bank", "sram", "rom" };
+    struct nsfstats_s stats;
+    int i;
+
+    nsf_stats(nsf, &stats);
+
+    // one block per song, even with several players on other threads
+    flockfile(file);
+
+    fprintf(file, "Stats: \'%.32s\' song %i\n", nsf->head.name, nsf->song+1);
+    fprintf(file, "  init:   %llu instructions, %llu cycles\n",
+            (unsigned long long)stats.init_instructions, (unsigned long long)stats.init_cycles);
+    fprintf(file, "  play:   %llu calls, %llu instructions, %llu cycles",
+            (unsigned long long)stats.play_calls, (unsigned long long)stats.play_instructions, (unsigned long long)stats.play_cycles);
+    if(stats.play_calls)
+        fprintf(file, ", %llu cycles per call", (unsigned long long)(stats.play_cycles/stats.play_calls));
+    fprintf(file, "\n");
+
+    fprintf(file, "  fetch:  %llu\n", (unsigned long long)stats.fetches);
+    fprintf(file, "  read: ");
+    for(i = 0; i < NSF_REGIONS; ++i)
+        fprintf(file, " %s %llu", regions[i], (unsigned long long)stats.reads[i]);
+    fprintf(file, "\n  write:");
+    for(i = 0; i < NSF_REGIONS; ++i)
+        fprintf(file, " %s %llu", regions[i], (unsigned long long)stats.writes[i]);
+    fprintf(file, "\n  bank switches: %llu\n", (unsigned long long)stats.bankswitches);
+
+    fprintf(file, "  apu writes:");
+    for(i = 0; i < 0x18; ++i)
+    {
+        if(stats.apu.writes[i])
+            fprintf(file, " $%04X %llu", 0x4000+i, (unsigned long long)stats.apu.writes[i]);
+    }
+    fprintf(file, "\n  frame counter: %llu quarter, %llu half frames\n",
+            (unsigned long long)stats.apu.quarter_frames, (unsigned long long)stats.apu.half_frames);
+    fprintf(file, "  dmc fetches: %llu\n", (unsigned long long)stats.apu.dmc_fetches);
+
+    funlockfile(file);
+}
+
+// dumps the counts of the song that was playing, if any
+static void nsf_endsong(struct nsf_s* nsf)
+{
+    if(nsf->song >= 0)
+        nsf_printstats(nsf, stderr);
+}
+
+static byte nsf_region(word addr)
+{
+    if(addr <= 0x1fff)
+        return NSF_REGION_RAM;
+    if(addr >= 0x8000)
+        return NSF_REGION_ROM;
+    if(addr >= 0x6000)
+        return NSF_REGION_SRAM;
+    if(addr >= 0x5ff8)
+        return NSF_REGION_BANK;
+    return NSF_REGION_IO;
+}
+#endif
+
+static uint64_t nsf_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// CPU cycle of a read or write happening now. the play routine runs ahead
+// of the APU, so its accesses carry the cycle they happen on; anything else
+// happens where the APU is.
+static uint64_t nsf_now(struct nsf_s* nsf)
+{
+    if(nsf->call_timed)
+        return nsf->call_start + nsf->call_done + (CALL_SLICE - nsf->cpu.ICount);
+
+    return apu_clock(nsf->apu);
+}
+
+void nsf_write(struct nsf_s* nsf, word addr, byte data)
+{
+    if(addr <= 0x7ff)
+    {
+        nsf->wram[addr] = data;
+    }
+    else
+    if(addr <= 0x1fff)
+    {
+        nsf->wram[addr&0x7ff] = data;
+    }
+    else
+    if( BIT(nsf->head.extsnd, 3) && (addr >= 0x5c00) && (addr <= 0x5ff5) )
+    {
+        nsf->exram[addr-0x5c00] = data;
+    }
+    else
+    if( BIT(nsf->head.extsnd, 3) && ((addr == 0x5205) || (addr == 0x5206)) )
+    {
+        nsf->multiplier[addr-0x5205] = data;
+    }
+    else
+    if( nsf->fdsram && (addr >= 0x5ff6) && (addr <= 0x5fff) )
+    {
+        if(nsf->use_bankswitching == 1)
+        {
+            cart_fdsswitch(nsf, addr-0x5ff6, data);
+            STAT(++nsf->stats.bankswitches;)
+        }
+        else
+        if(addr >= 0x5ff8)
+            nsf->bankswitch[addr&0x7] = data;
+    }
+    else
+    if( nsf->fdsram && (addr >= 0x6000) && (addr <= 0xdfff) )
+    {
+        nsf->fdsram[addr-0x6000] = data;
+    }
+    else
+    if( (addr >= 0x5ff8) && (addr <= 0x5fff) )
+    {
+        if(nsf->use_bankswitching == 1)
+        {
+            cart_switch(nsf, addr&0x7, data);
+            STAT(++nsf->stats.bankswitches;)
+        }
+        else
+            nsf->bankswitch[addr&0x7] = data;
+    }
+    else
+    if( (addr >= 0x6000) && (addr <= 0x7fff) )
+    {
+        nsf->sram[addr-0x6000] = data;
+    }
+    else
+    {
+        apu_write(nsf->apu, nsf_now(nsf), addr, data);
+    }
+}
+
+byte nsf_read(struct nsf_s* nsf, word addr)
+{
+    if(addr <= 0x7ff)
+    {
+        return nsf->wram[addr];
+    }
+    else
+    if(addr <= 0x1fff)
+    {
+        return nsf->wram[addr&0x7ff];
+    }
+    else if(addr >= 0x8000)
+    {
+        return nsf->pages[(addr>>12)&0x7][addr&0xfff];
+    }
+    else
+    if( (addr >= 0x5ff8) && (addr <= 0x5fff) )
+    {
+        return nsf->bankswitch[addr&0x7];
+    }
+    else
+    if( BIT(nsf->head.extsnd, 3) && (addr >= 0x5c00) && (addr <= 0x5ff5) )
+    {
+        return nsf->exram[addr-0x5c00];
+    }
+    else
+    if( BIT(nsf->head.extsnd, 3) && ((addr == 0x5205) || (addr == 0x5206)) )
+    {
+        return (nsf->multiplier[0] * nsf->multiplier[1]) >> ((addr-0x5205)<<3);
+    }
+    else
+    if( (addr >= 0x6000) && (addr <= 0x7fff) )
+    {
+        if(nsf->fdsram)
+            return nsf->fdsram[addr-0x6000];
+        return nsf->sram[addr-0x6000];
+    }
+    else
+    if( (addr >= 0x4000) && nsf->apu )
+    {
+        // $4015 and the expansion chips
+        return apu_read(nsf->apu, nsf_now(nsf), addr);
+    }
+    else
+    return 0;
+}
+
+// DMC sample fetches from the APU
+static byte nsf_dmcread(void* param, word addr)
+{
+    return nsf_read((struct nsf_s*)param, addr);
+}
+
+void Wr6502(register word Addr,register byte Value)
+{
+    STAT(++nsfctx->stats.writes[nsf_region(Addr)];)
+    nsf_write(nsfctx, Addr, Value);
+}
+
+byte Rd6502(register word Addr)
+{
+    STAT(++nsfctx->stats.reads[nsf_region(Addr)];)
+    return nsf_read(nsfctx, Addr);
+}
+
+byte Loop6502(register M6502 *R)
+{
+    if(R->PC.W < (nsfctx->fdsram ? 0x6000 : 0x8000))   // out of code section
+        return INT_QUIT;
+
+    return INT_NONE;
+}
+
+byte Patch6502(register byte Op,register M6502 *R)
+{
+    return 0;
+}
+
+#define M_PUSH(Rg)	Wr6502(0x0100|R->S,Rg);R->S--
+#define M_POP(Rg)	R->S++;Rg=Op6502(0x0100|R->S)
+
+// opcode and operand fetches, built with FAST_RDOP
+byte Op6502(register word Addr)
+{
+    struct nsf_s* nsf = nsfctx;
+
+    STAT(++nsf->stats.fetches;)
+
+    if(Addr >= 0x8000)
+        return nsf->pages[(Addr>>12)&0x7][Addr&0xfff];
+
+    if( (Addr == CALL_RETURN) && (nsf->cpu.PC.W == CALL_RETURN+1) )
+    {
+        // the routine returned: execute a NOP in place of whatever is at
+        // the return address and make it end the current batch
+        nsf->call_returned = 1;
+        nsf->call_icount = nsf->cpu.ICount;
+        nsf->cpu.ICount = 2;     // a NOP takes 2 cycles, ending the batch at 0
+        return 0xEA;
+    }
+
+    return nsf_read(nsf, Addr);
+}
+
+// runs the routine at PC until it returns, in batches of CALL_SLICE cycles
+// returns the exact number of cycles the routine took, including its RTS
+static int Call6502(struct nsf_s* nsf, register word PC, register byte A, register byte X)
+{
+    register M6502 *R = &nsf->cpu;
+    int left;
+    int cycles;
+    R->A = A;
+    R->X = X;
+    R->Y = 0;
+    R->P = 0;
+    R->S = 255;
+    R->PC.W = PC;
+
+    nsfctx = nsf;
+
+    M_PUSH(0);
+    M_PUSH(0);
+    cycles = 0;
+    nsf->call_returned = 0;
+    STAT(nsf->call_instructions = 0;)
+
+    while(R->PC.W >2)
+    {
+        nsf->call_done = cycles;
+        left = Exec6502(R, CALL_SLICE);
+
+        if(nsf->call_returned)
+            left = nsf->call_icount;
+        STAT(else ++nsf->call_instructions;)
+
+        cycles += CALL_SLICE - left;
+    }
+
+    STAT(nsf->call_cycles = cycles;)
+    return cycles;
+}
+
+// Call6502() with the profile kept up to date
+static int nsf_call(struct nsf_s* nsf, word PC, byte A, byte X)
+{
+    uint64_t start = 0;
+    int cycles;
+
+    if(nsf->profiling)
+        start = nsf_clock_ns();
+
+    cycles = Call6502(nsf, PC, A, X);
+    nsf->profile.cpu_cycles += cycles;
+    ++nsf->profile.calls;
+
+    if(nsf->profiling)
+        nsf->profile.cpu_ns += nsf_clock_ns() - start;
+
+    return cycles;
+}
+
+// start playing 'song', 0 based
+int nsf_init(struct nsf_s* nsf, byte song)
+{
+    byte X, A;
+    int i;
+
+    STAT(nsf_endsong(nsf);)
+    STAT(memset(&nsf->stats, 0, sizeof(nsf->stats));)
+
+    memset(&nsf->profile, 0, sizeof(nsf->profile));
+
+    memset(nsf->wram, 0x00, 0x800);
+    memset(nsf->exram, 0x00, 0x400);
+
+    // non bankswitched tunes are simply banks 0-7 mapped in order, or 0-9
+    // from $6000 for FDS tunes
+    if(nsf->fdsram)
+    {
+        // the RAM is loaded again, the tune may have written over it. $6000
+        // and $7000 get the banks of $E000 and $F000 from the header.
+        for(i = 0; i < 10; ++i)
+        {
+            if(nsf->use_bankswitching == 1)
+                cart_fdsswitch(nsf, i, nsf->head.bankswitch[(i+6)&0x7]);
+            else
+                cart_fdsswitch(nsf, i, i);
+        }
+    }
+    else
+    {
+        for(i = 0; i < 8; ++i)
+        {
+            if(nsf->use_bankswitching == 1)
+                cart_switch(nsf, i, nsf->head.bankswitch[i]);
+            else
+                cart_switch(nsf, i, i);
+        }
+    }
+
+    if(BIT(nsf->head.palntsc,0) | BIT(nsf->head.palntsc, 1))
+    {
+        X = 1; // PAL
+    }
+    else
+    {
+        X = 0; // NTSC
+    }
+
+    if(nsf->apu)
+        apu_destroy(nsf->apu);
+
+    nsf->apu = apu_create(nsf->samplerate, X);
+    if(!nsf->apu)
+        return 0;
+
+    apu_setmemread(nsf->apu, nsf_dmcread, nsf);
+    if(!apu_setsynthesis(nsf->apu, nsf->synthesis))
+        return 0;
+    apu_setgain(nsf->apu, nsf->gain);
+    for(i = 0; i < APU_OPTIONS; ++i)
+        apu_setoption(nsf->apu, i, nsf->options[i]);
+    apu_reset(nsf->apu, nsf->head.extsnd);
+
+    // the first play call comes right after init, on cycle 0
+    nsf->playPeriod = (uint64_t)nsf_playspeed(nsf) * apu_cpuclock(nsf->apu);
+    nsf->playNext = 0;
+
+    A = song;
+
+    // init is not timed, its writes all happen before the first sample
+    nsf->cpu.Trap = nsf->head.init;
+    nsf->call_timed = 0;
+    nsf_call(nsf, nsf->head.init, A, X);
+
+#ifdef NSF_STATS
+    nsf->stats.init_instructions = nsf->call_instructions;
+    nsf->stats.init_cycles = nsf->call_cycles;
+    nsf->song = song;
+#endif
+
+    return 1;
+}
+
+// call the play routine on the cycle it is due. its writes reach the APU on
+// the cycles they happen on, once rendering gets there.
+static void nsf_play(struct nsf_s* nsf)
+{
+    uint64_t end;
+
+    nsf->call_start = nsf->playNext / 1000000;
+    nsf->call_timed = 1;
+    end = nsf->call_start + nsf_call(nsf, nsf->head.play, 0, 0);
+    nsf->call_timed = 0;
+
+    // a routine that ran into the next frame makes that play call wait
+    // for the one after, like on the real thing
+    do
+        nsf->playNext += nsf->playPeriod;
+    while(nsf->playNext / 1000000 < end);
+
+    STAT(++nsf->stats.play_calls;)
+    STAT(nsf->stats.play_instructions += nsf->call_instructions;)
+    STAT(nsf->stats.play_cycles += nsf->call_cycles;)
+}
+
+// nsf_render() of 'length' frames, each of 1+nsf_stems() samples if 'stems'
+static void nsf_renderframes(struct nsf_s* nsf, int16_t* buffer, int length, int stems)
+{
+    int channels = stems ? 1 + apu_stems(nsf->apu) : 1;
+    uint64_t start = 0;
+    uint32_t n;
+
+    while(length > 0)
+    {
+        // play runs before the sample its first cycle falls into is rendered
+        n = apu_samplesbefore(nsf->apu, nsf->playNext / 1000000);
+        if(n == 0)
+        {
+            nsf_play(nsf);
+            continue;
+        }
+
+        // everything up to the next play call in one block
+        if(n > (uint32_t)length)
+            n = length;
+
+        if(nsf->profiling)
+            start = nsf_clock_ns();
+
+        if(stems)
+            apu_renderstems(nsf->apu, buffer, n);
+        else
+            apu_render(nsf->apu, buffer, n);
+
+        if(nsf->profiling)
+            nsf->profile.apu_ns += nsf_clock_ns() - start;
+        nsf->profile.frames += n;
+
+        buffer += n*channels;
+        length -= n;
+    }
+}
+
+// fill buffer with the next 'length' samples of the tune started by nsf_init,
+// calling the play routine on the CPU cycle of each of its frames
+void nsf_render(struct nsf_s* nsf, int16_t* buffer, int length)
+{
+    nsf_renderframes(nsf, buffer, length, 0);
+}
+
+// the stems nsf_renderstems() adds to the mix, known after nsf_init()
+int nsf_stems(struct nsf_s* nsf)
+{
+    return nsf->apu ? apu_stems(nsf->apu) : 0;
+}
+
+const char* nsf_stemname(struct nsf_s* nsf, int stem)
+{
+    return nsf->apu ? apu_stemname(nsf->apu, stem) : NULL;
+}
+
+// nsf_render() with each APU channel and expansion chip on a track of its
+// own as well. buffer takes 'length' interleaved frames of 1+nsf_stems()
+// samples, the mix first.
+void nsf_renderstems(struct nsf_s* nsf, int16_t* buffer, int length)
+{
+    nsf_renderframes(nsf, buffer, length, 1);
+}
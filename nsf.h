@@ -0,0 +1,110 @@
+#ifndef NSF_H_INCLUDED
+#define NSF_H_INCLUDED
+
+#include "M6502/M6502.h"
+#include "apu.h"
+#include <stdio.h>
+#include <stdint.h>
+
+struct nsfhead_s
+{
+    char id[5];     // needs to be set as 'N','E','S','M',0x1A in the file
+    byte version;   // currently 1
+    byte songs;     // # of songs in nsf
+    byte start;     // starting song, 1 based
+    word load;      // load address of data
+    word init;      // init address of song
+    word play;      // play address of song
+    char name[32];      // name of song
+    char artist[32];    // name of artist
+    char copyright[32]; // copyright info
+    word speedntsc;         // play speed 1/1000000th second ticks for ntsc
+    byte bankswitch[8];     // bankswitch register data
+    word speedpal;          // play speed 1/1000000th second ticks for pal
+    byte palntsc;           // use pal, ntsc, or both
+    byte extsnd;            // external sound chip support
+    byte reserved[4];       // reserved for future use (right, like it's gonna be updated ever)
+    // sound data
+}__attribute__((packed));
+
+// nsf_open() error codes
+#define NSF_OK          0
+#define NSF_ERR_OPEN    1   // could not open the file
+#define NSF_ERR_SHORT   2   // shorter than the header
+#define NSF_ERR_ID      3   // not a NSF file
+#define NSF_ERR_VERSION 4
+#define NSF_ERR_NOSONGS 5
+#define NSF_ERR_LOAD    6   // load address below $8000
+#define NSF_ERR_READ    7   // could not read the sound data
+#define NSF_ERR_MEMORY  8
+
+// A player instance owns everything needed to emulate one tune: the
+// cartridge image, the 6502 and its memory map, and the APU. Instances
+// share no state, so any number of them may run at once, each on one
+// thread at a time.
+struct nsf_s;
+
+// where the time goes, since the last nsf_init()
+struct nsfprofile_s
+{
+    uint64_t cpu_ns;        // wall time spent in the init and play routines
+    uint64_t apu_ns;        // wall time spent rendering samples
+    uint64_t cpu_cycles;    // 6502 cycles the routines took
+    uint64_t calls;         // init and play calls
+    uint64_t frames;        // samples rendered
+    uint32_t cpu_clock;     // emulated CPU clock in Hz
+};
+
+#ifdef NSF_STATS
+// Rd6502()/Wr6502() address regions
+#define NSF_REGION_RAM      0   // $0000-$1FFF
+#define NSF_REGION_IO       1   // $2000-$5FF7, the APU among others
+#define NSF_REGION_BANK     2   // $5FF8-$5FFF bankswitch registers
+#define NSF_REGION_SRAM     3   // $6000-$7FFF
+#define NSF_REGION_ROM      4   // $8000-$FFFF
+#define NSF_REGIONS         5
+
+// what the emulation did, since the last nsf_init()
+struct nsfstats_s
+{
+    uint64_t init_instructions;
+    uint64_t init_cycles;
+    uint64_t play_calls;
+    uint64_t play_instructions;
+    uint64_t play_cycles;
+    uint64_t fetches;               // Op6502() opcode and operand reads
+    uint64_t reads[NSF_REGIONS];
+    uint64_t writes[NSF_REGIONS];
+    uint64_t bankswitches;
+    struct apustats_s apu;
+};
+#endif
+
+struct nsf_s* nsf_open(const char* filename, int samplerate, int* error);
+void nsf_close(struct nsf_s* nsf);
+const char* nsf_strerror(int error);
+
+const struct nsfhead_s* nsf_header(struct nsf_s* nsf);
+byte nsf_bankswitched(struct nsf_s* nsf);
+float nsf_playfreq(struct nsf_s* nsf);
+int nsf_playsamples(struct nsf_s* nsf);
+void nsf_setsynthesis(struct nsf_s* nsf, byte mode);
+void nsf_setgain(struct nsf_s* nsf, float gain);
+void nsf_setoption(struct nsf_s* nsf, int option, int value);
+void nsf_setprofiling(struct nsf_s* nsf, int enable);
+void nsf_profile(struct nsf_s* nsf, struct nsfprofile_s* profile);
+#ifdef NSF_STATS
+void nsf_stats(struct nsf_s* nsf, struct nsfstats_s* stats);
+void nsf_printstats(struct nsf_s* nsf, FILE* file);
+#endif
+
+int nsf_init(struct nsf_s* nsf, byte song);
+void nsf_render(struct nsf_s* nsf, int16_t* buffer, int length);
+int nsf_stems(struct nsf_s* nsf);
+const char* nsf_stemname(struct nsf_s* nsf, int stem);
+void nsf_renderstems(struct nsf_s* nsf, int16_t* buffer, int length);
+
+byte nsf_read(struct nsf_s* nsf, word addr);
+void nsf_write(struct nsf_s* nsf, word addr, byte data);
+
+#endif // NSF_H_INCLUDED
@@ -0,0 +1,320 @@
+#include "render.h"
+#include "sink.h"
+#include "wav.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// render a song straight to a WAV or raw file, as fast as the emulation
+// runs. stops after opts->seconds, or once the output has not changed for
+// opts->silence seconds. with opts->stems the file gets a channel for the
+// mix and one for every stem, silence is still judged by the mix.
+int render_to_file(struct nsf_s* nsf, byte song, const char* filename, const struct renderopts_s* opts)
+{
+    struct sink_s* sink;
+    struct sinkformat_s format;
+    int16_t* buffer;
+    uint32_t total = (uint32_t)opts->seconds*opts->samplerate;
+    uint32_t silent = 0;
+    int16_t last;
+    int channels, len, j;
+
+    // the stems are known once the song is set up
+    nsf_setsynthesis(nsf, opts->synthesis);
+    nsf_setgain(nsf, opts->gain);
+    nsf_setoption(nsf, APU_OPT_N163_MIX, opts->n163mix);
+    if(!nsf_init(nsf, song))
+        return 0;
+
+    channels = opts->stems ? 1 + nsf_stems(nsf) : 1;
+
+    memset(&format, 0, sizeof(format));
+    format.rate = opts->samplerate;
+    format.channels = channels;
+
+    sink = sink_open((opts->format == WAV_FORMAT_RAW) ? SINK_RAW : SINK_WAV, filename, &format);
+    if(!sink)
+        return 0;
+
+    len = nsf_playsamples(nsf)*4;
+    buffer = malloc(len*channels*sizeof(int16_t));
+    if(!buffer)
+    {
+        sink_close(sink);
+        return 0;
+    }
+
+    last = 0;
+    while(sink_frames(sink) < total)
+    {
+        len = nsf_playsamples(nsf)*4;
+        if(total - sink_frames(sink) < (uint32_t)len)
+            len = total - sink_frames(sink);
+
+        if(opts->stems)
+            nsf_renderstems(nsf, buffer, len);
+        else
+            nsf_render(nsf, buffer, len);
+
+        if(!sink_write(sink, buffer, len))
+            break;
+
+        if(opts->silence > 0)
+        {
+            for(j = 0; j < len*channels; j += channels)
+            {
+                if(buffer[j] != last)
+                    silent = 0;
+                else
+                    ++silent;
+
+                last = buffer[j];
+            }
+
+            if(silent >= (uint32_t)opts->silence*opts->samplerate)
+                break;
+        }
+    }
+
+    free(buffer);
+
+    return sink_close(sink);
+}
+
+// outdir/<name without extension>_<song>.wav, or .raw. 'song' is 1 based.
+char* render_outname(const char* nsffile, int song, const char* outdir, int format)
+{
+    const char* base = strrchr(nsffile, '/');
+    const char* ext;
+    size_t baselen;
+    char* name;
+
+    base = base ? base+1 : nsffile;
+    ext = strrchr(base, '.');
+    baselen = ext ? (size_t)(ext-base) : strlen(base);
+
+    name = malloc(strlen(outdir) + baselen + 16);
+    if(!name)
+        return NULL;
+
+    sprintf(name, "%s/%.*s_%02i.%s", outdir, (int)baselen, base, song, (format == WAV_FORMAT_RAW) ? "raw" : "wav");
+    return name;
+}
+
+// builds the job list from "file.nsf" (every song) and "file.nsf:N" (song N
+// only) arguments. returns NULL if a file can not be loaded, a song is out
+// of range or two jobs would write the same output file.
+struct renderjob_s* render_makejobs(char** args, int count, const char* outdir, const struct renderopts_s* opts, int* jobcount)
+{
+    struct renderjob_s* jobs = NULL;
+    struct renderjob_s* grown;
+    struct nsf_s* nsf;
+    char* file;
+    char* colon;
+    char* end;
+    int songs, first, last, single;
+    int error;
+    int i, j, s, n = 0;
+
+    for(i = 0; i < count; ++i)
+    {
+        file = strdup(args[i]);
+        if(!file)
+            goto make_error;
+
+        single = 0;
+        colon = strrchr(file, ':');
+        if(colon && colon[1])
+        {
+            first = strtol(colon+1, &end, 10);
+            if(*end == '\0')
+            {
+                *colon = '\0';
+                single = 1;
+            }
+        }
+
+        nsf = nsf_open(file, opts->samplerate, &error);
+        if(!nsf)
+        {
+            fprintf(stderr, "Error: \'%s\': %s.\n", file, nsf_strerror(error));
+            free(file);
+            goto make_error;
+        }
+        songs = nsf_header(nsf)->songs;
+        nsf_close(nsf);
+
+        if(single && (first < 1 || first > songs))
+        {
+            fprintf(stderr, "Error: \'%s\': song %i out of range 1-%i.\n", file, first, songs);
+            free(file);
+            goto make_error;
+        }
+
+        if(single)
+            last = first;
+        else
+        {
+            first = 1;
+            last = songs;
+        }
+
+        grown = realloc(jobs, (n + last-first+1)*sizeof(struct renderjob_s));
+        if(!grown)
+        {
+            free(file);
+            goto make_error;
+        }
+        jobs = grown;
+
+        for(s = first; s <= last; ++s)
+        {
+            // the first job of a file owns the file name
+            jobs[n].nsffile = (s == first) ? file : jobs[n-1].nsffile;
+            jobs[n].song = s-1;
+            jobs[n].outfile = render_outname(file, s, outdir, opts->format);
+            jobs[n].result = 0;
+            ++n;
+
+            if(!jobs[n-1].outfile)
+                goto make_error;
+
+            // the output is named after the file name only, so files of the
+            // same name in other directories, or a song given twice, clash
+            for(j = 0; j < n-1; ++j)
+            {
+                if(strcmp(jobs[j].outfile, jobs[n-1].outfile) == 0)
+                {
+                    fprintf(stderr, "Error: \'%s\' and \'%s\' would both be written to \'%s\'.\n", jobs[j].nsffile, file, jobs[n-1].outfile);
+                    goto make_error;
+                }
+            }
+        }
+    }
+
+    *jobcount = n;
+    return jobs;
+
+make_error:
+    render_freejobs(jobs, n);
+    *jobcount = 0;
+    return NULL;
+}
+
+void render_freejobs(struct renderjob_s* jobs, int count)
+{
+    int i;
+
+    if(jobs == NULL)
+        return;
+
+    for(i = 0; i < count; ++i)
+    {
+        if( (i == 0) || (jobs[i].nsffile != jobs[i-1].nsffile) )
+            free(jobs[i].nsffile);
+        free(jobs[i].outfile);
+    }
+
+    free(jobs);
+}
+
+struct renderpool_s
+{
+    struct renderjob_s* jobs;
+    int count;
+    const struct renderopts_s* opts;
+
+    pthread_mutex_t lock;
+    int next;           // next job to hand out
+    int done;
+};
+
+static void *render_worker(void* param)
+{
+    struct renderpool_s* pool = param;
+    struct renderjob_s* job;
+    struct nsf_s* nsf;
+    int error;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        job = (pool->next < pool->count) ? &pool->jobs[pool->next++] : NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(job == NULL)
+            break;
+
+        // every job gets its own instance, nothing is shared between workers
+        nsf = nsf_open(job->nsffile, pool->opts->samplerate, &error);
+        if(nsf)
+        {
+            job->result = render_to_file(nsf, job->song, job->outfile, pool->opts);
+            nsf_close(nsf);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        ++pool->done;
+        if(job->result)
+            printf("[%i/%i] %s\n", pool->done, pool->count, job->outfile);
+        else
+            fprintf(stderr, "[%i/%i] Error: could not render song %i of \'%s\'.\n", pool->done, pool->count, job->song+1, job->nsffile);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+// renders every job on a pool of 'threads' workers. returns the number of
+// jobs that failed.
+int render_batch(struct renderjob_s* jobs, int count, int threads, const struct renderopts_s* opts)
+{
+    struct renderpool_s pool;
+    pthread_t* workers;
+    int started, failed, i;
+
+    if(count <= 0)
+        return 0;
+
+    if(threads < 1)
+        threads = 1;
+    if(threads > count)
+        threads = count;
+
+    workers = malloc(threads*sizeof(pthread_t));
+    if(!workers)
+        return count;
+
+    pool.jobs = jobs;
+    pool.count = count;
+    pool.opts = opts;
+    pool.next = 0;
+    pool.done = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    for(started = 0; started < threads; ++started)
+    {
+        if(pthread_create(&workers[started], NULL, render_worker, &pool) != 0)
+            break;
+    }
+
+    // if no thread could be created at all, do the work on this one
+    if(started == 0)
+        render_worker(&pool);
+
+    for(i = 0; i < started; ++i)
+        pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&pool.lock);
+    free(workers);
+
+    failed = 0;
+    for(i = 0; i < count; ++i)
+    {
+        if(!jobs[i].result)
+            ++failed;
+    }
+
+    return failed;
+}
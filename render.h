@@ -0,0 +1,33 @@
+#ifndef RENDER_H_INCLUDED
+#define RENDER_H_INCLUDED
+
+#include "nsf.h"
+
+struct renderopts_s
+{
+    int samplerate;
+    int format;     // WAV_FORMAT_WAV or WAV_FORMAT_RAW
+    int seconds;    // length to render
+    int silence;    // stop after this many seconds of unchanged output, 0 = never
+    byte synthesis; // APU_SYNTH_POINT or APU_SYNTH_BLEP
+    float gain;     // 1.0 = unchanged
+    int n163mix;    // APU_N163_MULTIPLEX or APU_N163_AVERAGE
+    int stems;      // one channel per stem after the mix, see nsf_renderstems()
+};
+
+struct renderjob_s
+{
+    char* nsffile;
+    byte song;          // 0 based
+    char* outfile;
+    int result;         // set by render_batch(), 1 if the file was written
+};
+
+int render_to_file(struct nsf_s* nsf, byte song, const char* filename, const struct renderopts_s* opts);
+
+struct renderjob_s* render_makejobs(char** args, int count, const char* outdir, const struct renderopts_s* opts, int* jobcount);
+void render_freejobs(struct renderjob_s* jobs, int count);
+int render_batch(struct renderjob_s* jobs, int count, int threads, const struct renderopts_s* opts);
+char* render_outname(const char* nsffile, int song, const char* outdir, int format);
+
+#endif // RENDER_H_INCLUDED
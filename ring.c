@@ -0,0 +1,143 @@
+#include "ring.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ring_s
+{
+    int16_t* buf;
+    uint32_t size;          // power of two
+    uint32_t mask;
+
+    // free running frame counters, the fill is head - tail. head is only
+    // stored by the producer and tail only by the consumer, each on its own
+    // cache line.
+    _Alignas(64) _Atomic uint32_t head;
+    _Alignas(64) _Atomic uint32_t tail;
+
+    _Alignas(64) _Atomic uint32_t lowfill;
+    _Atomic uint32_t underruns;
+    _Atomic uint64_t written;
+};
+
+// 'frames' is rounded up to a power of two
+struct ring_s* ring_create(uint32_t frames)
+{
+    struct ring_s* ring;
+    uint32_t size = 1;
+
+    if(frames == 0 || frames > 0x40000000)
+        return NULL;
+
+    while(size < frames)
+        size <<= 1;
+
+    ring = aligned_alloc(64, (sizeof(struct ring_s)+63) & ~63);
+    if(!ring)
+        return NULL;
+
+    ring->buf = calloc(size, sizeof(int16_t));
+    if(!ring->buf)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->size = size;
+    ring->mask = size-1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->lowfill, size);
+    atomic_init(&ring->underruns, 0);
+    atomic_init(&ring->written, 0);
+
+    return ring;
+}
+
+void ring_destroy(struct ring_s* ring)
+{
+    if(ring == NULL)
+        return;
+
+    free(ring->buf);
+    free(ring);
+}
+
+uint32_t ring_fill(struct ring_s* ring)
+{
+    // tail first: head only grows, so it cannot end up behind it
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - tail;
+}
+
+uint32_t ring_space(struct ring_s* ring)
+{
+    return ring->size - ring_fill(ring);
+}
+
+// producer side: copies in as many of 'frames' as fit, returns how many
+uint32_t ring_write(struct ring_s* ring, const int16_t* buffer, uint32_t frames)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t space = ring->size - (head - tail);
+    uint32_t pos, first;
+
+    if(frames > space)
+        frames = space;
+
+    // the free space may wrap around the end of the buffer
+    pos = head & ring->mask;
+    first = ring->size - pos;
+    if(first > frames)
+        first = frames;
+
+    memcpy(ring->buf + pos, buffer, first*sizeof(int16_t));
+    memcpy(ring->buf, buffer + first, (frames-first)*sizeof(int16_t));
+
+    atomic_store_explicit(&ring->head, head + frames, memory_order_release);
+    atomic_fetch_add_explicit(&ring->written, frames, memory_order_relaxed);
+
+    return frames;
+}
+
+// consumer side: copies out up to 'frames', returns how many
+uint32_t ring_read(struct ring_s* ring, int16_t* buffer, uint32_t frames)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t fill = head - tail;
+    uint32_t pos, first;
+
+    if(fill < atomic_load_explicit(&ring->lowfill, memory_order_relaxed))
+        atomic_store_explicit(&ring->lowfill, fill, memory_order_relaxed);
+
+    if(frames > fill)
+    {
+        frames = fill;
+        atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+    }
+
+    pos = tail & ring->mask;
+    first = ring->size - pos;
+    if(first > frames)
+        first = frames;
+
+    memcpy(buffer, ring->buf + pos, first*sizeof(int16_t));
+    memcpy(buffer + first, ring->buf, (frames-first)*sizeof(int16_t));
+
+    atomic_store_explicit(&ring->tail, tail + frames, memory_order_release);
+
+    return frames;
+}
+
+// safe to call from any thread, the numbers may be a moment old
+void ring_stats(struct ring_s* ring, struct ringstats_s* stats)
+{
+    stats->size = ring->size;
+    stats->fill = ring_fill(ring);
+    stats->lowfill = atomic_load_explicit(&ring->lowfill, memory_order_relaxed);
+    stats->underruns = atomic_load_explicit(&ring->underruns, memory_order_relaxed);
+    stats->written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+}
@@ -0,0 +1,32 @@
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+
+#include <stdint.h>
+
+// Lock-free ring of 16 bit samples between exactly one producer thread
+// (ring_write) and one consumer thread (ring_read). Neither side ever
+// blocks, a full or empty ring just moves fewer frames.
+
+struct ring_s;
+
+struct ringstats_s
+{
+    uint32_t size;          // frames the ring holds
+    uint32_t fill;          // frames in it right now
+    uint32_t lowfill;       // lowest fill any ring_read() started with
+    uint32_t underruns;     // ring_read() calls that came up short
+    uint64_t written;       // frames through the ring so far
+};
+
+struct ring_s* ring_create(uint32_t frames);
+void ring_destroy(struct ring_s* ring);
+
+uint32_t ring_fill(struct ring_s* ring);
+uint32_t ring_space(struct ring_s* ring);
+
+uint32_t ring_write(struct ring_s* ring, const int16_t* buffer, uint32_t frames);
+uint32_t ring_read(struct ring_s* ring, int16_t* buffer, uint32_t frames);
+
+void ring_stats(struct ring_s* ring, struct ringstats_s* stats);
+
+#endif // RING_H_INCLUDED
@@ -0,0 +1,268 @@
+#include "s5b.h"
+#include "square.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define S5B_SELECT      0xC000
+#define S5B_DATA        0xE000
+
+// registers behind S5B_DATA
+#define S5B_TONE        0x00    // 12 bit periods, 2 registers per channel
+#define S5B_NOISE       0x06
+#define S5B_MIXER       0x07    // tone and noise disable bits
+#define S5B_VOLUME      0x08    // 3 registers, bit 4 selects the envelope
+#define S5B_ENVPERIOD   0x0B    // 16 bit
+#define S5B_ENVSHAPE    0x0D
+
+// the shape bits, writing them restarts the envelope
+#define S5B_HOLD        0x01
+#define S5B_ALTERNATE   0x02
+#define S5B_ATTACK      0x04
+#define S5B_CONTINUE    0x08
+
+// output of one channel at each of the 32 envelope levels, 1.5dB apart.
+// a 4 bit volume v is level 2v+1. full volume is a little quieter than a
+// full 2A03 pulse.
+static const int32_t s5b_levels[32] =
+{
+       0,   51,   60,   71,   85,  101,  120,  143,
+     170,  201,  239,  285,  338,  402,  478,  568,
+     675,  802,  953, 1133, 1347, 1600, 1902, 2261,
+    2687, 3193, 3795, 4511, 5361, 6372, 7573, 9000,
+};
+
+struct s5btone_s
+{
+    struct square_s timer;  // the low bit of its step is the square wave
+    word period;
+    byte volume;
+    byte envelope;          // use the envelope level instead of the volume
+};
+
+struct s5benv_s
+{
+    struct square_s timer;
+    word period;
+    byte shape;
+    byte attack;            // counting up
+    byte holding;           // stopped at 'level'
+    byte pos;               // 0-31 within the current ramp
+    byte level;
+};
+
+struct s5b_s
+{
+    byte select;
+    byte mixer;
+    struct s5btone_s tone[3];
+    struct square_s noise;  // steps once per shift of the LFSR
+    uint32_t lfsr;          // 17 bit
+    struct s5benv_s env;
+};
+
+static void* s5b_init(uint32_t cpu_clock)
+{
+    return calloc(1, sizeof(struct s5b_s));
+}
+
+static void s5b_cleanup(void* chip)
+{
+    free(chip);
+}
+
+// the timers count CPU cycles: a tone flips every 16*period of them, so its
+// square wave is 32*period long, the envelope steps every 16*period and the
+// noise shifts every 32*period
+static void s5b_reset(void* chip)
+{
+    struct s5b_s* s5b = chip;
+    int i;
+
+    memset(s5b, 0, sizeof(struct s5b_s));
+    for(i = 0; i < 3; ++i)
+        square_reset(&s5b->tone[i].timer, 16);
+    square_reset(&s5b->noise, 32);
+    square_reset(&s5b->env.timer, 16);
+    s5b->lfsr = 1;
+    s5b->mixer = 0x3F;
+    s5b->env.holding = 1;
+}
+
+static void s5b_env_restart(struct s5benv_s* env, byte shape)
+{
+    env->shape = shape&0x0F;
+    env->attack = (env->shape & S5B_ATTACK) != 0;
+    env->holding = 0;
+    env->pos = 0;
+    env->level = env->attack ? 0 : 31;
+    square_reset(&env->timer, 16*(env->period ? env->period : 1));
+}
+
+static int s5b_write(void* chip, word addr, byte data)
+{
+    struct s5b_s* s5b = chip;
+    struct s5btone_s* tone;
+    byte reg;
+
+    if(addr == S5B_SELECT)
+    {
+        s5b->select = data&0x0F;
+        return 1;
+    }
+
+    if(addr != S5B_DATA)
+        return 0;
+
+    reg = s5b->select;
+    switch(reg)
+    {
+        case S5B_TONE:   case S5B_TONE+1:
+        case S5B_TONE+2: case S5B_TONE+3:
+        case S5B_TONE+4: case S5B_TONE+5:
+            tone = &s5b->tone[reg>>1];
+            if(reg&1)
+                tone->period = (tone->period&0x0FF) | ((data&0x0F)<<8);
+            else
+                tone->period = (tone->period&0xF00) | data;
+            square_setperiod(&tone->timer, 16*(tone->period ? tone->period : 1));
+            break;
+        case S5B_NOISE:
+            square_setperiod(&s5b->noise, 32*((data&0x1F) ? (data&0x1F) : 1));
+            break;
+        case S5B_MIXER:
+            s5b->mixer = data;
+            break;
+        case S5B_VOLUME:
+        case S5B_VOLUME+1:
+        case S5B_VOLUME+2:
+            tone = &s5b->tone[reg-S5B_VOLUME];
+            tone->volume = data&0x0F;
+            tone->envelope = BIT(data, 4);
+            break;
+        case S5B_ENVPERIOD:
+            s5b->env.period = (s5b->env.period&0xFF00) | data;
+            square_setperiod(&s5b->env.timer, 16*(s5b->env.period ? s5b->env.period : 1));
+            break;
+        case S5B_ENVPERIOD+1:
+            s5b->env.period = (s5b->env.period&0x00FF) | (data<<8);
+            square_setperiod(&s5b->env.timer, 16*(s5b->env.period ? s5b->env.period : 1));
+            break;
+        case S5B_ENVSHAPE:
+            s5b_env_restart(&s5b->env, data);
+            break;
+    }
+
+    return 1;
+}
+
+static int s5b_read(void* chip, word addr)
+{
+    return -1;  // write only
+}
+
+// move the envelope on by 'steps' steps at once. a looping envelope only
+// needs its position in the ramp and, alternating, the direction.
+static void s5b_env_run(struct s5benv_s* env, uint32_t steps)
+{
+    uint32_t pos, ramps;
+
+    if(env->holding || !steps)
+        return;
+
+    pos = env->pos + steps;
+    if(pos >= 32)
+    {
+        if(!(env->shape & S5B_CONTINUE))
+        {
+            env->holding = 1;
+            env->level = 0;
+            return;
+        }
+
+        if(env->shape & S5B_HOLD)
+        {
+            env->holding = 1;
+            env->level = (env->attack ^ ((env->shape & S5B_ALTERNATE) != 0)) ? 31 : 0;
+            return;
+        }
+
+        ramps = pos / 32;
+        pos %= 32;
+        if((env->shape & S5B_ALTERNATE) && (ramps & 1))
+            env->attack ^= 1;
+    }
+
+    env->pos = pos;
+    env->level = env->attack ? pos : 31 - pos;
+}
+
+static void s5b_process(void* chip, uint32_t cycles)
+{
+    struct s5b_s* s5b = chip;
+    uint32_t shifts;
+    int i;
+
+    for(i = 0; i < 3; ++i)
+        square_run(&s5b->tone[i].timer, cycles);
+
+    s5b_env_run(&s5b->env, square_run(&s5b->env.timer, cycles));
+
+    // a handful of shifts per output sample at most
+    for(shifts = square_run(&s5b->noise, cycles); shifts > 0; --shifts)
+        s5b->lfsr = (s5b->lfsr>>1) | (((s5b->lfsr ^ (s5b->lfsr>>3)) & 1)<<16);
+}
+
+static inline int32_t s5b_tone_level(const struct s5b_s* s5b, int i)
+{
+    const struct s5btone_s* tone = &s5b->tone[i];
+
+    if(!((tone->timer.step&1) | BIT(s5b->mixer, i)))
+        return 0;
+    if(!((s5b->lfsr&1) | BIT(s5b->mixer, (i+3))))
+        return 0;
+
+    if(tone->envelope)
+        return s5b_levels[s5b->env.level];
+    if(tone->volume)
+        return s5b_levels[2*tone->volume+1];
+
+    return 0;
+}
+
+static int32_t s5b_output(void* chip)
+{
+    struct s5b_s* s5b = chip;
+
+    return (s5b_tone_level(s5b, 0) + s5b_tone_level(s5b, 1) + s5b_tone_level(s5b, 2))<<16;
+}
+
+static const char* const s5b_stemnames[] =
+{
+    "5B tone A", "5B tone B", "5B tone C", NULL
+};
+
+static void s5b_stems(void* chip, int32_t* levels)
+{
+    struct s5b_s* s5b = chip;
+    int i;
+
+    for(i = 0; i < 3; ++i)
+        levels[i] = s5b_tone_level(s5b, i)<<16;
+}
+
+const apumapper_t s5b_mapper =
+{
+    "Sunsoft 5B",
+    s5b_init,
+    s5b_cleanup,
+    s5b_reset,
+    s5b_write,
+    s5b_read,
+    0,
+    0,
+    s5b_process,
+    s5b_output,
+    NULL,
+    s5b_stemnames,
+    s5b_stems,
+};
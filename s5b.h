@@ -0,0 +1,11 @@
+#ifndef S5B_H_INCLUDED
+#define S5B_H_INCLUDED
+
+#include "apu.h"
+
+// Sunsoft 5B, a YM2149F (AY-3-8910) variant: three square channels with
+// a shared noise generator and envelope. Registers are selected by writing
+// their number to $C000 and then written at $E000.
+extern const apumapper_t s5b_mapper;
+
+#endif // S5B_H_INCLUDED
@@ -0,0 +1,223 @@
+#include "sink.h"
+#include "alsa.h"
+#include "wav.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SINK_PERIOD 1024    // block size for sinks that do not care
+
+typedef void* (*sinkopen_t)(const char* target, struct sinkformat_s* format);
+typedef int (*sinkwrite_t)(void* handle, const int16_t* buffer, uint32_t frames);
+typedef void (*sinkdrain_t)(void* handle);
+typedef int (*sinkclose_t)(void* handle);
+
+typedef struct sinkops_s
+{
+    const char* name;
+    sinkopen_t open;        // negotiates 'format', returns NULL on failure
+    sinkwrite_t write;      // returns 1 once all frames are taken, 0 on error
+    sinkdrain_t drain;      // waits until everything written has been played
+    sinkclose_t close;      // returns 0 if anything could not be finished
+}sinkops_t;
+
+struct sink_s
+{
+    const sinkops_t* ops;
+    void* handle;
+    struct sinkformat_s format;
+    uint64_t frames;
+};
+
+// null sink, needs no state at all
+
+static char sink_null_handle;
+
+static void* sink_null_open(const char* target, struct sinkformat_s* format)
+{
+    return &sink_null_handle;
+}
+
+static int sink_null_write(void* handle, const int16_t* buffer, uint32_t frames)
+{
+    return 1;
+}
+
+static void sink_null_drain(void* handle)
+{
+}
+
+static int sink_null_close(void* handle)
+{
+    return 1;
+}
+
+// WAV and raw files
+
+static void* sink_file_open(const char* target, struct sinkformat_s* format, int fileformat)
+{
+    if(target == NULL)
+        return NULL;
+
+    return wav_open(target, fileformat, format->rate, 16, format->channels);
+}
+
+static void* sink_wav_open(const char* target, struct sinkformat_s* format)
+{
+    return sink_file_open(target, format, WAV_FORMAT_WAV);
+}
+
+static void* sink_raw_open(const char* target, struct sinkformat_s* format)
+{
+    return sink_file_open(target, format, WAV_FORMAT_RAW);
+}
+
+static int sink_file_write(void* handle, const int16_t* buffer, uint32_t frames)
+{
+    return wav_write((struct wavfile_s*)handle, buffer, frames);
+}
+
+static void sink_file_drain(void* handle)
+{
+}
+
+static int sink_file_close(void* handle)
+{
+    return wav_close((struct wavfile_s*)handle);
+}
+
+// ALSA, 'target' is the device name or NULL for the default one
+
+static void* sink_alsa_open(const char* target, struct sinkformat_s* format)
+{
+    struct alsa_s* alsa;
+
+    alsa = alsa_open(target, format->rate, format->channels, format->latency_ms ? format->latency_ms : ALSA_LATENCY_MS);
+    if(!alsa)
+        return NULL;
+
+    format->rate = alsa_rate(alsa);
+    format->period = alsa_period(alsa);
+    format->latency_ms = alsa_buffer(alsa)*1000 / alsa_rate(alsa);
+    format->realtime = 1;
+
+    return alsa;
+}
+
+static int sink_alsa_write(void* handle, const int16_t* buffer, uint32_t frames)
+{
+    return alsa_write((struct alsa_s*)handle, buffer, frames) == 0;
+}
+
+static void sink_alsa_drain(void* handle)
+{
+    alsa_drain((struct alsa_s*)handle);
+}
+
+static int sink_alsa_close(void* handle)
+{
+    alsa_close((struct alsa_s*)handle);
+    return 1;
+}
+
+static const sinkops_t sink_ops[] =
+{
+    { "null", sink_null_open, sink_null_write, sink_null_drain, sink_null_close },  // SINK_NULL
+    { "wav",  sink_wav_open,  sink_file_write, sink_file_drain, sink_file_close },  // SINK_WAV
+    { "raw",  sink_raw_open,  sink_file_write, sink_file_drain, sink_file_close },  // SINK_RAW
+    { "alsa", sink_alsa_open, sink_alsa_write, sink_alsa_drain, sink_alsa_close },  // SINK_ALSA
+};
+
+#define SINK_TYPES (int)(sizeof(sink_ops)/sizeof(sink_ops[0]))
+
+// SINK_* for a name like "wav", -1 if there is no such sink
+int sink_type(const char* name)
+{
+    int i;
+
+    for(i = 0; i < SINK_TYPES; ++i)
+    {
+        if(strcmp(name, sink_ops[i].name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+const char* sink_name(int type)
+{
+    if(type < 0 || type >= SINK_TYPES)
+        return "unknown";
+
+    return sink_ops[type].name;
+}
+
+// 'target' is the file name for file sinks and the device for SINK_ALSA.
+// 'format' holds the wanted format and gets what the sink settled on.
+struct sink_s* sink_open(int type, const char* target, struct sinkformat_s* format)
+{
+    struct sink_s* sink;
+
+    if(type < 0 || type >= SINK_TYPES)
+        return NULL;
+
+    sink = calloc(1, sizeof(struct sink_s));
+    if(!sink)
+        return NULL;
+
+    sink->ops = &sink_ops[type];
+    sink->format = *format;
+    sink->format.realtime = 0;
+
+    sink->handle = sink->ops->open(target, &sink->format);
+    if(!sink->handle)
+    {
+        free(sink);
+        return NULL;
+    }
+
+    if(sink->format.period == 0)
+        sink->format.period = SINK_PERIOD;
+
+    *format = sink->format;
+    return sink;
+}
+
+int sink_write(struct sink_s* sink, const int16_t* buffer, uint32_t frames)
+{
+    if(!sink->ops->write(sink->handle, buffer, frames))
+        return 0;
+
+    sink->frames += frames;
+    return 1;
+}
+
+void sink_drain(struct sink_s* sink)
+{
+    sink->ops->drain(sink->handle);
+}
+
+// returns 0 if the sink could not be finished properly, like a WAV header
+// that could not be written
+int sink_close(struct sink_s* sink)
+{
+    int ok;
+
+    if(sink == NULL)
+        return 1;
+
+    ok = sink->ops->close(sink->handle);
+    free(sink);
+
+    return ok;
+}
+
+const struct sinkformat_s* sink_format(struct sink_s* sink)
+{
+    return &sink->format;
+}
+
+// frames taken so far
+uint64_t sink_frames(struct sink_s* sink)
+{
+    return sink->frames;
+}
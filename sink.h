@@ -0,0 +1,36 @@
+#ifndef SINK_H_INCLUDED
+#define SINK_H_INCLUDED
+
+#include <stdint.h>
+
+// Where rendered audio goes. Every sink takes blocks of interleaved signed
+// 16 bit frames in the format agreed on by sink_open().
+
+#define SINK_NULL   0   // throws everything away, only counts frames
+#define SINK_WAV    1   // WAV file
+#define SINK_RAW    2   // headerless PCM file
+#define SINK_ALSA   3   // sound card
+
+struct sinkformat_s
+{
+    unsigned int rate;
+    unsigned int channels;
+    uint32_t period;            // frames per sink_write() the sink prefers, 0 = any
+    unsigned int latency_ms;    // device buffer wanted by SINK_ALSA
+    int realtime;               // set by sinks that play at the sample rate
+};
+
+struct sink_s;
+
+int sink_type(const char* name);
+const char* sink_name(int type);
+
+struct sink_s* sink_open(int type, const char* target, struct sinkformat_s* format);
+int sink_write(struct sink_s* sink, const int16_t* buffer, uint32_t frames);
+void sink_drain(struct sink_s* sink);
+int sink_close(struct sink_s* sink);
+
+const struct sinkformat_s* sink_format(struct sink_s* sink);
+uint64_t sink_frames(struct sink_s* sink);
+
+#endif // SINK_H_INCLUDED
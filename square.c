@@ -0,0 +1,36 @@
+#include "square.h"
+
+// restart the timer with a new period, at step 0
+void square_reset(struct square_s* sq, uint32_t period)
+{
+    sq->period = period ? period : 1;
+    sq->timer = sq->period;
+    sq->step = 0;
+}
+
+// takes effect on the current step already if that is past the new period
+void square_setperiod(struct square_s* sq, uint32_t period)
+{
+    sq->period = period ? period : 1;
+    if(sq->timer > sq->period)
+        sq->timer = sq->period;
+}
+
+// run for 'cycles' CPU cycles, returns the number of steps taken
+uint32_t square_run(struct square_s* sq, uint32_t cycles)
+{
+    uint32_t steps;
+
+    if(cycles < sq->timer)
+    {
+        sq->timer -= cycles;
+        return 0;
+    }
+
+    cycles -= sq->timer;
+    steps = 1 + cycles / sq->period;
+    sq->timer = sq->period - cycles % sq->period;
+    sq->step += steps;
+
+    return steps;
+}
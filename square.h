@@ -0,0 +1,22 @@
+#ifndef SQUARE_H_INCLUDED
+#define SQUARE_H_INCLUDED
+
+#include <stdint.h>
+
+// The timer and step counter behind the square channels of the expansion
+// chips, and behind the envelope, noise and frame timers that step the same
+// way. The timer counts 'period' CPU cycles down and then moves 'step' on
+// by one; square_run() takes a whole block of cycles at once, however many
+// steps fall into it.
+struct square_s
+{
+    uint32_t period;    // CPU cycles per step, at least 1
+    uint32_t timer;     // cycles left to the next step, at least 1
+    uint32_t step;      // steps taken, channels use its low bits as the sequence position
+};
+
+void square_reset(struct square_s* sq, uint32_t period);
+void square_setperiod(struct square_s* sq, uint32_t period);
+uint32_t square_run(struct square_s* sq, uint32_t cycles);
+
+#endif // SQUARE_H_INCLUDED
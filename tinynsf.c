@@ -4,13 +4,17 @@
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
-#include "M6502/M6502.h"
+#include "nsf.h"
 #include "apu.h"
 
 #include <sys/ioctl.h>
-#include <alsa/asoundlib.h>
+#include <time.h>
 
-#include "audioconfig.h"
+#include "alsa.h"
+#include "sink.h"
+#include "wav.h"
+#include "render.h"
+#include "ring.h"
 
 
 #define SAMPLE_RATE 48000
@@ -18,381 +22,163 @@
 
 #define NO_AALIB
 
-// Close an opened audio device, free any allocated buffers and
-// reset any variables that reflect the current state.
-void Audio_ALSA_close (snd_pcm_t *handle, void* buffer)
-{
-    if (handle != NULL )
-    {
-        snd_pcm_close(handle);
-        free(buffer);
-    }
-}
+struct nsf_s* nsf;
 
-void *Audio_ALSA_open (AudioConfig *cfg, snd_pcm_t **handle)
-{
-    AudioConfig tmpCfg;
-    int rtn;
+#ifdef DEBUG
+    FILE *debugFile;
+#endif
 
-    if ((rtn = snd_pcm_open (handle, "default", SND_PCM_STREAM_PLAYBACK, 0)))
-    {
-        goto open_error;
-    }
+void *audiobuffer;
+int bufferlen;
+struct sink_s* audiosink;
+int sinkType = SINK_ALSA;
+const char* sinkTarget = NULL;
+unsigned int latencyMs = ALSA_LATENCY_MS;
+volatile int playing;
 
-   memcpy(&tmpCfg, cfg, sizeof(AudioConfig));
+#define RING_FRAMES 8192
 
-    snd_pcm_hw_params_t *hw;
+struct ring_s* ring;
+uint32_t ringFrames = RING_FRAMES;
 
-    if((rtn = snd_pcm_hw_params_malloc(&hw)) < 0)
-    {
-        goto open_error;
-    }
+#ifndef DEBUG
+#ifndef NO_AALIB
+aa_context* context;
+#endif
+#endif
+// producer: emulates ahead of the audio thread, one play period at a time,
+// as long as there is room in the ring
+void *emu_thread(void* param)
+{
+    int len = nsf_playsamples(nsf);
+    int16_t* buffer = malloc(len*sizeof(int16_t));
+    uint32_t done;
 
-    if((rtn = snd_pcm_hw_params_any(*handle, hw)) < 0)
-    {
-        goto open_error;
-    }
+    if(!buffer)
+        return NULL;
 
-    if((rtn = snd_pcm_hw_params_set_access(*handle, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+    while(playing)
     {
-        goto open_error;
-    }
+        nsf_render(nsf, buffer, len);
 
-    if ( tmpCfg.bits == 8 )
-    {
-        if((rtn = snd_pcm_hw_params_set_format(*handle, hw, SND_PCM_FORMAT_S8)) < 0)
+        done = 0;
+        while(playing)
         {
-            goto open_error;
+            done += ring_write(ring, buffer+done, len-done);
+            if(done == (uint32_t)len)
+                break;
+            usleep(1000);
         }
     }
-    if ( tmpCfg.bits == 16 )
-    {
-        if((rtn = snd_pcm_hw_params_set_format(*handle, hw, SND_PCM_FORMAT_S16_LE)) < 0)
-        {
-            goto open_error;
-        }
-    }
-
-    if((rtn = snd_pcm_hw_params_set_rate_near(*handle, hw, &tmpCfg.frequency, 0)) < 0)
-    {
-        goto open_error;
-    }
-
-    if((rtn = snd_pcm_hw_params_set_channels(*handle, hw, tmpCfg.channels)) < 0)
-    {
-        goto open_error;
-    }
-
-    if((rtn = snd_pcm_hw_params_set_buffer_size(*handle, hw, tmpCfg.bufSize*tmpCfg.bits/8)) < 0)
-    {
-        goto open_error;
-    }
 
-    if((rtn = snd_pcm_hw_params(*handle, hw)) < 0)
-    {
-        goto open_error;
-    }
-
-    snd_pcm_hw_params_free (hw);
-
-    void* buffer = malloc(tmpCfg.bufSize*tmpCfg.bits/8);
-
-    if (!buffer)
-    {
-        goto open_error;
-    }
-
-    return buffer;
-
-open_error:
-    if (*handle != NULL)
-    {
-        Audio_ALSA_close (*handle, buffer);
-    }
-
-    perror ("ALSA");
-return NULL;
+    free(buffer);
+    return NULL;
 }
 
-void *Audio_ALSA_write (snd_pcm_t *handle, void* buffer, snd_pcm_sframes_t length)
+// consumer: drains the ring into the audio sink
+void *play_thread(void* param)
 {
-    if (handle == NULL)
-    {
+    pthread_t emuThread;
+    struct ringstats_s stats;
+    struct sinkformat_s format;
+    struct timespec start, end;
+    double seconds;
+    uint32_t got;
+    int16_t last = 0;
+    int waited, blockms, j;
+
+    if(!nsf_init(nsf, (int)param))
+    {
+        fprintf(stderr, "Could not start song %i.\n", (int)param+1);
+        playing = 0;
         return NULL;
     }
 
-    snd_pcm_sframes_t remaining = length;
-    snd_pcm_sframes_t written = 0;
-    int8_t* buff_cur = (int8_t*)buffer;
+    memset(&format, 0, sizeof(format));
+    format.rate = SAMPLE_RATE;
+    format.channels = 1;
+    format.latency_ms = latencyMs;
 
-    while(remaining > 0)
+    audiosink = sink_open(sinkType, sinkTarget, &format);
+    if(!audiosink)
     {
-        written = snd_pcm_writei (handle, (void*)buff_cur, remaining);
-        if(written < 0)
-        {
-            snd_pcm_recover(handle, written, 1);
-        }
-        else if(written <= remaining)
-        {
-            remaining -= written;
-            buff_cur += written<<(SAMPLE_BITS>>3);
-        }
+        fprintf(stderr, "Could not open the %s sink.\n", sink_name(sinkType));
+        return NULL;
     }
-    return (void *) buffer;
-}
-
-byte nes_wram[0x800];
-byte nes_sram[0x2000];
-
-struct nsfhead_s
-{
-    char id[5];     // needs to be set as 'N','E','S','M',0x1A in the file
-    byte version;   // currently 1
-    byte songs;     // # of songs in nsf
-    byte start;     // starting song, 1 based
-    word load;      // load address of data
-    word init;      // init address of song
-    word play;      // play address of song
-    char name[32];      // name of song
-    char artist[32];    // name of artist
-    char copyright[32]; // copyright info
-    word speedntsc;         // play speed 1/1000000th second ticks for ntsc
-    byte bankswitch[8];     // bankswitch register data
-    word speedpal;          // play speed 1/1000000th second ticks for pal
-    byte palntsc;           // use pal, ntsc, or both
-    byte extsnd;            // external sound chip support
-    byte reserved[4];       // reserved for future use (right, like it's gonna be updated ever)
-    // sound data
-}__attribute__((packed));
-
-FILE *nsFile = NULL;
-struct nsfhead_s nsfHead;
-
-byte bankswitch[8];
-byte use_bankswitching = 0;
-word bank_padding;
-
-float nsf_playfreq;
-
-byte cart_read_sequential(word addr);
-
-typedef byte (*cart_read_t)(word addr);
-cart_read_t cart_read = cart_read_sequential;
-
-inline byte read_nsf_data(word offset)
-{
-    fseek(nsFile, offset+sizeof(struct nsfhead_s), SEEK_SET);
-    int data = fgetc(nsFile);
-
-    if(data == -1)
-        return 0;
 
-    return data;
-}
-
-byte cart_read_sequential(word addr)
-{
-    if(nsFile == NULL)
+    // one sink period per write
+    bufferlen = format.period;
+    audiobuffer = malloc(bufferlen*sizeof(int16_t));
+    if(!audiobuffer)
     {
-        return 0;
+        sink_close(audiosink);
+        return NULL;
     }
 
-    return read_nsf_data(addr-nsfHead.load);
-}
-
-byte cart_read_bankswitch(word addr)
-{
-    // find which bank the address is located in, 0-7
-    byte bank = (addr-0x8000)>>12;
-
-    if(addr <= (0x8000|bank_padding))
-            return 0;
-
-    return read_nsf_data(bankswitch[bank]*0x1000 + (addr&0xFFF) - bank_padding );
-}
-
-M6502 cpu;
-
-#ifdef DEBUG
-    FILE *debugFile;
-#endif
-
-void Wr6502(register word Addr,register byte Value)
-{
-    if(Addr <= 0x7ff)
-    {
-        nes_wram[Addr] = Value;
-    }
-    else
-    if(Addr <= 0x1fff)
-    {
-        nes_wram[Addr&0x7ff] = Value;
-    }
-    else
-    if( (Addr >= 0x5ff8) && (Addr <= 0x5fff) )
-    {
-        bankswitch[(Addr&0xF)-8] = Value;
-    }
+    if(format.realtime)
+        printf("Output: %s, %u Hz, period %u frames, %u ms\n", sink_name(sinkType), format.rate, format.period, format.latency_ms);
     else
-    if( (Addr >= 0x6000) && (Addr <= 0x7fff) )
-    {
-    #ifdef DEBUG
-     //   fprintf(debugFile, "SRAM write    : $%04X set to $%02X\n", Addr, Value);
-    #endif
-        nes_sram[Addr-0x6000] = Value;
-    }
-    else
-    {
-        apu_write(Addr, Value);
-    }
-}
+        printf("Output: %s, %u Hz, not paced\n", sink_name(sinkType), format.rate);
 
-byte Rd6502(register word Addr)
-{
-    if(Addr <= 0x7ff)
-    {
-        return nes_wram[Addr];
-    }
-    else
-    if(Addr <= 0x1fff)
-    {
-        return nes_wram[Addr&0x7ff];
-    }
-    else if(Addr >= 0x8000)
-    {
-        return cart_read(Addr);
-    }
-    else
-    if( (Addr >= 0x5ff8) && (Addr <= 0x5fff) )
-    {
-        return bankswitch[(Addr&0xF)-8];
-    }
-    else
-    if( (Addr >= 0x6000) && (Addr <= 0x7fff) )
-    {
-    #ifdef DEBUG
-     //   fprintf(debugFile, "SRAM read: $%04X is $%02X\n", Addr, nes_sram[Addr-0x6000]);
-        return nes_sram[Addr-0x6000];
-    #else
-        return nes_sram[Addr-0x6000];
-    #endif
-    }
-    else
-    return 0;
-}
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-byte Loop6502(register M6502 *R)
-{
-    if(R->PC.W < 0x8000)    // out of code section
-        return INT_QUIT;
+    // the ring has to hold at least a couple of sink writes
+    ring = ring_create((ringFrames > (uint32_t)bufferlen*2) ? ringFrames : (uint32_t)bufferlen*2);
+    if(!ring)
+        goto play_error;
 
-    return INT_NONE;
-}
-
-byte Patch6502(register byte Op,register M6502 *R)
-{
-    return 0;
-}
-
-#define M_PUSH(Rg)	Wr6502(0x0100|R->S,Rg);R->S--
-#define M_POP(Rg)	R->S++;Rg=Op6502(0x0100|R->S)
-int Call6502(register M6502 *R, register word PC, register byte A, register byte X)
-{
-    int icycles;
-    int cycles;
-    R->A = A;
-    R->X = X;
-    R->Y = 0;
-    R->P = 0;
-    R->S = 255;
-    R->PC.W = PC;
-
-    M_PUSH(0);
-    M_PUSH(0);
-    cycles = 0;
-
-    while(R->PC.W >2)
+    if(pthread_create(&emuThread, NULL, emu_thread, NULL) != 0)
     {
-        icycles = (1-Exec6502(R, 1));
-        cycles += icycles;
+        ring_destroy(ring);
+        ring = NULL;
+        goto play_error;
     }
 
-    return cycles;
-}
+    // let the producer get ahead before the first write
+    while(playing && (ring_space(ring) > (uint32_t)bufferlen))
+        usleep(1000);
 
-void *audiobuffer;
-int bufferlen;
-snd_pcm_t *audiohandle;
-int samplesPerPlay;
-volatile int playing;
-struct apu_s* apu;
-void initNSF(byte song)
-{
-    samplesPerPlay = (((float)SAMPLE_RATE)/nsf_playfreq);
-    bufferlen = samplesPerPlay*4;
-    AudioConfig cfg = {SAMPLE_RATE, SAMPLE_BITS, 1, 0,bufferlen};
-    audiobuffer = Audio_ALSA_open(&cfg, &audiohandle);
-
-    memset(nes_wram, 0x00, 0x800);
-
-    cart_read = cart_read_sequential;
-    if(use_bankswitching == 1)
-    {
-        memcpy(bankswitch, nsfHead.bankswitch, 8);
-        cart_read = cart_read_bankswitch;
-        bank_padding = nsfHead.load & 0xfff;
-    }
-
-    byte X, A;
-
-    if(BIT(nsfHead.palntsc,0) | BIT(nsfHead.palntsc, 1))
-    {
-        X = 1; // PAL
-    }
-    else
-    {
-        X = 0; // NTSC
-    }
-
-    apu = apu_create(SAMPLE_RATE, X);
-    apu_setcontext(apu);
-    apu_reset(0);
-
-    A = song;
-
-    cpu.Trap = nsfHead.init;
-    Call6502(&cpu, nsfHead.init, A, X);
-}
+    blockms = bufferlen*1000/SAMPLE_RATE + 1;
 
 #ifndef DEBUG
 #ifndef NO_AALIB
-aa_context* context;
+    int16_t* cur;
 #endif
 #endif
-void *play_thread(void* param)
-{
-    initNSF((int)param);
-
-    int j;
-    int16_t* cur;
     while(playing)
     {
-        cur = (int16_t*)audiobuffer;
+        // give a late play routine up to one block's time to catch up,
+        // after that the last sample is held for whatever is missing. the
+        // APU is silent far from 0, so zeros would click. sinks that are
+        // not paced by a clock just wait for it.
+        for(waited = 0; (ring_fill(ring) < (uint32_t)bufferlen) && ((waited < blockms) || !format.realtime) && playing; ++waited)
+            usleep(1000);
 
+        if(!playing)
+            break;
+
+        got = ring_read(ring, (int16_t*)audiobuffer, bufferlen);
+        if(got > 0)
+            last = ((int16_t*)audiobuffer)[got-1];
+        for(j = got; j < bufferlen; ++j)
+            ((int16_t*)audiobuffer)[j] = last;
+
+    #ifndef DEBUG
+    #ifndef NO_AALIB
+        cur = (int16_t*)audiobuffer;
         for(j = 0; j < bufferlen; ++j)
         {
-            if(j%(samplesPerPlay) == 0)Call6502(&cpu, nsfHead.play, 0, 0);
-            *cur = apu_output()>>16;
-        #ifndef DEBUG
-        #ifndef NO_AALIB
             aa_putpixel(context, ((aa_imgwidth(context)<<8)/bufferlen*j)>>8,  ((aa_imgheight(context)*((int)(0x7fff-(*cur))))>>16) - (aa_imgheight(context)/3), 127);
-        #endif
-        #endif
             ++cur;
         }
+    #endif
+    #endif
 
-
-        Audio_ALSA_write(audiohandle, audiobuffer, bufferlen);
+        if(!sink_write(audiosink, (int16_t*)audiobuffer, bufferlen))
+        {
+            fprintf(stderr, "Audio output failed.\n");
+            playing = 0;
+        }
 
     #ifndef DEBUG
     #ifndef NO_AALIB
@@ -404,9 +190,23 @@ void *play_thread(void* param)
     #endif
     }
 
+    pthread_join(emuThread, NULL);
+
+    ring_stats(ring, &stats);
+    printf("Ring: %u frames, lowest fill %u, %u underruns\n", stats.size, stats.lowfill, stats.underruns);
+
+    ring_destroy(ring);
+    ring = NULL;
 
-    Audio_ALSA_close(audiohandle, audiobuffer);
-    apu_destroy(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+    printf("Output: %llu frames in %.2f s, %.1fx real time\n", (unsigned long long)sink_frames(audiosink), seconds,
+           sink_frames(audiosink)/(double)format.rate/seconds);
+
+play_error:
+    sink_drain(audiosink);
+    sink_close(audiosink);
+    free(audiobuffer);
 
     return NULL;
 }
@@ -414,17 +214,34 @@ void *play_thread(void* param)
 #define VER_MAJ 0
 #define VER_REV 1
 
+#define RENDER_SECONDS 180
+
 void usage(void)
 {
-    fprintf(stderr,"Usage: tinynsf file.nsf\n");
+    fprintf(stderr,"Usage: tinynsf [options] file.nsf\n");
+    fprintf(stderr,"       tinynsf -d dir [options] file.nsf[:song] ...\n");
+    fprintf(stderr,"  -o file     render to a file instead of playing\n");
+    fprintf(stderr,"  -r          write raw signed 16 bit PCM instead of WAV\n");
+    fprintf(stderr,"  -s song     song to render, 1 based (default: the tune's start song)\n");
+    fprintf(stderr,"  -t seconds  length to render (default: %i)\n", RENDER_SECONDS);
+    fprintf(stderr,"  -q seconds  stop rendering after this much silence (default: off)\n");
+    fprintf(stderr,"  -b          band-limited synthesis, cleaner but a little slower\n");
+    fprintf(stderr,"  -g gain     output volume, clipped when too loud (default: 1.0)\n");
+    fprintf(stderr,"  -N          mix the Namco 163 channels evenly instead of multiplexing them\n");
+    fprintf(stderr,"  -S          with -o or -d, also write every APU channel and chip as a channel of its own\n");
+    fprintf(stderr,"  -d dir      render every song (or just :song) of each file into dir\n");
+    fprintf(stderr,"  -j threads  number of songs rendered at once with -d (default: one per CPU)\n");
+    fprintf(stderr,"  -n frames   samples buffered ahead of the audio device (default: %i)\n", RING_FRAMES);
+    fprintf(stderr,"  -l ms       audio device latency (default: %i)\n", ALSA_LATENCY_MS);
+    fprintf(stderr,"  -a sink     play to alsa[:device], null, wav:file or raw:file (default: alsa)\n");
 }
 
 void errorExit(int code)
 {
-    if(nsFile != NULL)
+    if(nsf != NULL)
     {
-        fclose(nsFile);
-        nsFile = NULL;
+        nsf_close(nsf);
+        nsf = NULL;
     }
 
     exit(code);
@@ -433,77 +250,169 @@ void errorExit(int code)
 int main(int argc, char **argv)
 {
     int i;
+    int opt;
+    int error;
+    const struct nsfhead_s* nsfHead;
+    const char* outFile = NULL;
+    int outFormat = WAV_FORMAT_WAV;
+    int renderSong = 0;
+    int renderSeconds = RENDER_SECONDS;
+    int renderSilence = 0;
+    const char* batchDir = NULL;
+    int batchThreads = 0;
+    byte synthesis = APU_SYNTH_POINT;
+    float gain = 1.0f;
+    int n163mix = APU_N163_MULTIPLEX;
+    int stems = 0;
+    struct renderopts_s opts;
+
     printf("TinyNSF v%i.%i\n", VER_MAJ, VER_REV);
 
-    if(argc < 2)
+    while((opt = getopt(argc, argv, "o:rs:t:q:bg:NSd:j:n:l:a:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'o':
+                outFile = optarg;
+                break;
+            case 'r':
+                outFormat = WAV_FORMAT_RAW;
+                break;
+            case 's':
+                renderSong = atoi(optarg);
+                break;
+            case 't':
+                renderSeconds = atoi(optarg);
+                break;
+            case 'q':
+                renderSilence = atoi(optarg);
+                break;
+            case 'b':
+                synthesis = APU_SYNTH_BLEP;
+                break;
+            case 'g':
+                gain = atof(optarg);
+                break;
+            case 'N':
+                n163mix = APU_N163_AVERAGE;
+                break;
+            case 'S':
+                stems = 1;
+                break;
+            case 'd':
+                batchDir = optarg;
+                break;
+            case 'j':
+                batchThreads = atoi(optarg);
+                break;
+            case 'n':
+                ringFrames = atoi(optarg);
+                break;
+            case 'l':
+                latencyMs = atoi(optarg);
+                break;
+            case 'a':
+                sinkTarget = strchr(optarg, ':');
+                if(sinkTarget)
+                    *(char*)sinkTarget++ = '\0';
+                sinkType = sink_type(optarg);
+                if(sinkType < 0)
+                {
+                    fprintf(stderr, "Unknown sink \'%s\'.\n", optarg);
+                    usage();
+                    errorExit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage();
+                errorExit(EXIT_FAILURE);
+        }
+    }
+
+    if(optind >= argc)
     {
         fprintf(stderr, "Filename must be specified.\n");
         usage();
         errorExit(EXIT_FAILURE);
     }
 
-    nsFile = fopen(argv[1], "rb");
-    if(!nsFile)
+    if(stems && outFile == NULL && batchDir == NULL)
     {
-        fprintf(stderr, "Could not open specified file, \'%s\'.\n", argv[1]);
+        fprintf(stderr, "Stems can only be rendered to a file, use -o or -d.\n");
+        usage();
         errorExit(EXIT_FAILURE);
     }
 
+    opts.samplerate = SAMPLE_RATE;
+    opts.format = outFormat;
+    opts.seconds = renderSeconds;
+    opts.silence = renderSilence;
+    opts.synthesis = synthesis;
+    opts.gain = gain;
+    opts.n163mix = n163mix;
+    opts.stems = stems;
 
-    if(fread(&nsfHead, 1, sizeof(struct nsfhead_s), nsFile) < sizeof(struct nsfhead_s))
+    if(batchDir != NULL)
     {
-        fprintf(stderr, "Error: invalid file, shorter than NSF header.\n");
-        errorExit(EXIT_FAILURE);
-    }
+        struct renderjob_s* jobs;
+        int jobCount, failed;
 
-    if(memcmp(nsfHead.id, "NESM\x1A", 5) != 0)
-    {
-        fprintf(stderr, "Error: not a NSF file.\n");
-        errorExit(EXIT_FAILURE);
-    }
+        jobs = render_makejobs(argv+optind, argc-optind, batchDir, &opts, &jobCount);
+        if(!jobs)
+            errorExit(EXIT_FAILURE);
 
-    if(nsfHead.version != 1)
-    {
-        fprintf(stderr, "Error: invalid NSF version.\n");
-        errorExit(EXIT_FAILURE);
+        if(batchThreads <= 0)
+            batchThreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        printf("Rendering %i songs on %i threads...\n", jobCount, batchThreads);
+
+        failed = render_batch(jobs, jobCount, batchThreads, &opts);
+        render_freejobs(jobs, jobCount);
+
+        if(failed)
+        {
+            fprintf(stderr, "Error: %i of %i songs failed.\n", failed, jobCount);
+            errorExit(EXIT_FAILURE);
+        }
+
+        return 0;
     }
 
-    if( (nsfHead.songs == 0) || (nsfHead.start == 0) )
+    nsf = nsf_open(argv[optind], SAMPLE_RATE, &error);
+    if(!nsf)
     {
-        fprintf(stderr, "Error: no songs in NSF.\n");
+        if(error == NSF_ERR_OPEN)
+            fprintf(stderr, "Could not open specified file, \'%s\'.\n", argv[optind]);
+        else
+            fprintf(stderr, "Error: %s.\n", nsf_strerror(error));
         errorExit(EXIT_FAILURE);
     }
 
-    use_bankswitching = 0;
-    for(i = 0; i < 8; ++i)
-    {
-        if(nsfHead.bankswitch[i] != 0)
-        {
-            use_bankswitching = 1;
-            break;
-        }
-    }
+    nsfHead = nsf_header(nsf);
+    nsf_setsynthesis(nsf, synthesis);
+    nsf_setgain(nsf, gain);
+    nsf_setoption(nsf, APU_OPT_N163_MIX, n163mix);
 
     printf ("Loaded a valid NSF.\n\n");
     printf ("\n");
 
-    printf ("TITLE:\t\t%s\n", nsfHead.name);
-    printf ("ARTIST:\t\t%s\n", nsfHead.artist);
-    printf ("COPYRIGHT:\t%s\n", nsfHead.copyright);
+    printf ("TITLE:\t\t%s\n", nsfHead->name);
+    printf ("ARTIST:\t\t%s\n", nsfHead->artist);
+    printf ("COPYRIGHT:\t%s\n", nsfHead->copyright);
     printf ("\n");
 
-    printf ("Load:\t\t$%04X\n", nsfHead.load);
-    printf ("Init:\t\t$%04X\n", nsfHead.init);
-    printf ("Play:\t\t$%04X\n", nsfHead.play);
+    printf ("Load:\t\t$%04X\n", nsfHead->load);
+    printf ("Init:\t\t$%04X\n", nsfHead->init);
+    printf ("Play:\t\t$%04X\n", nsfHead->play);
     printf ("\n");
 
-    if(use_bankswitching == 1)
+    if(nsf_bankswitched(nsf))
     {
         printf ("Tune uses bankswitching:\n");
         printf ("Banks:\t\t");
         for(i = 0; i < 8; ++i)
         {
-            printf ("$%02X ", nsfHead.bankswitch[i]);
+            printf ("$%02X ", nsfHead->bankswitch[i]);
         }
 
         printf ("\n");
@@ -511,41 +420,68 @@ int main(int argc, char **argv)
     }
 
     printf ("Clock standard:\t");
-    if(nsfHead.palntsc&1)
+    if(nsfHead->palntsc&1)
     {
         printf ("PAL\n");
-        printf ("Play Freq: %f Hz\n", 1000000.0f / nsfHead.speedpal);
-        nsf_playfreq = 1000000.0f / nsfHead.speedpal;
+        printf ("Play Freq: %f Hz\n", 1000000.0f / nsfHead->speedpal);
     }
     else
-    if(nsfHead.palntsc>>1)
+    if(nsfHead->palntsc>>1)
     {
         printf ("PAL & NTSC\n");
         printf ("\n");
-        printf ("Play Freq PAL: %f Hz\n", 1000000.0f / nsfHead.speedpal);
-        printf ("Play Freq NTSC: %f Hz\n", 1000000.0f / nsfHead.speedntsc);
-        nsf_playfreq = 1000000.0f / nsfHead.speedpal;
+        printf ("Play Freq PAL: %f Hz\n", 1000000.0f / nsfHead->speedpal);
+        printf ("Play Freq NTSC: %f Hz\n", 1000000.0f / nsfHead->speedntsc);
     }
     else
     {
         printf ("NTSC\n");
-        printf ("Play Freq: %f Hz\n", 1000000.0f / nsfHead.speedntsc);
-        nsf_playfreq = 1000000.0f / nsfHead.speedntsc;
+        printf ("Play Freq: %f Hz\n", 1000000.0f / nsfHead->speedntsc);
     }
 
-    if(nsfHead.extsnd != 0)
+    if(nsfHead->extsnd != 0)
     {
         printf ("Tune uses extra sound chip(s):\n");
         printf ("\t");
-        if(BIT(nsfHead.extsnd, 0)) printf ("VRC6 ");
-        if(BIT(nsfHead.extsnd, 1)) printf ("VRC7 ");
-        if(BIT(nsfHead.extsnd, 2)) printf ("FDS ");
-        if(BIT(nsfHead.extsnd, 3)) printf ("MMC5 ");
-        if(BIT(nsfHead.extsnd, 4)) printf ("Namco_163 ");
-        if(BIT(nsfHead.extsnd, 5)) printf ("Sunsoft_5B ");
+        for(i = 0; i < APU_MAPPERS; ++i)
+        {
+            if(BIT(nsfHead->extsnd, i))
+                printf ("%s%s  ", apu_mappername(i), BIT(apu_mappers(), i) ? "" : " (not emulated)");
+        }
         printf ("\n");
     }
 
+    if(outFile != NULL)
+    {
+        if(renderSong == 0)
+            renderSong = nsfHead->start;
+
+        if( (renderSong < 1) || (renderSong > nsfHead->songs) )
+        {
+            fprintf(stderr, "Error: song %i out of range 1-%i.\n", renderSong, nsfHead->songs);
+            errorExit(EXIT_FAILURE);
+        }
+
+        printf("Rendering song %i/%i to \'%s\'...\n", renderSong, nsfHead->songs, outFile);
+
+        if(!render_to_file(nsf, renderSong-1, outFile, &opts))
+        {
+            fprintf(stderr, "Error: could not write \'%s\'.\n", outFile);
+            errorExit(EXIT_FAILURE);
+        }
+
+        if(stems)
+        {
+            printf("Channels:\tmix");
+            for(i = 0; i < nsf_stems(nsf); ++i)
+                printf(", %s", nsf_stemname(nsf, i));
+            printf("\n");
+        }
+
+        nsf_close(nsf);
+        return 0;
+    }
+
 #ifndef DEBUG
 #ifndef NO_AALIB
     context = aa_autoinit(&aa_defparams);
@@ -572,7 +508,7 @@ play_next:
         errorExit(0);
     }
 
-    printf("Song %i/%i\n", curSong, nsfHead.songs);
+    printf("Song %i/%i\n", curSong, nsfHead->songs);
     printf("Playing... press return to play next song.\n");
 
 #ifndef DEBUG
@@ -584,13 +520,13 @@ play_next:
     playing = 0;
     pthread_join(playThread, NULL);
 
-    if(curSong != nsfHead.songs)
+    if(curSong != nsfHead->songs)
     {
         ++curSong;
         goto play_next;
     }
 
-    fclose(nsFile);
+    nsf_close(nsf);
 
 #ifdef DEBUG
     fclose(debugFile);
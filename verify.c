@@ -0,0 +1,422 @@
+#include "verify.h"
+#include "nsf.h"
+#include "apu.h"
+#include "render.h"
+#include "wav.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define VERIFY_RATE     48000
+#define VERIFY_FNVINIT  0xcbf29ce484222325ULL
+#define VERIFY_FNVPRIME 0x100000001b3ULL
+
+// FNV-1a over the samples as little endian bytes, so hashes are the same
+// on every host
+uint64_t verify_hash(uint64_t hash, const int16_t* buffer, uint32_t frames)
+{
+    uint32_t i;
+
+    for(i = 0; i < frames; ++i)
+    {
+        hash = (hash ^ (byte)buffer[i]) * VERIFY_FNVPRIME;
+        hash = (hash ^ (byte)((uint16_t)buffer[i]>>8)) * VERIFY_FNVPRIME;
+    }
+
+    return hash;
+}
+
+// 'file' from a golden file. relative names are taken from the directory
+// the golden file is in, so that a golden file can travel with its tunes.
+static char* verify_path(const char* golden, const char* file)
+{
+    const char* slash = strrchr(golden, '/');
+    size_t dirlen = slash ? (size_t)(slash-golden)+1 : 0;
+    char* path;
+
+    if(file[0] == '/')
+        dirlen = 0;
+
+    path = malloc(dirlen + strlen(file) + 1);
+    if(!path)
+        return NULL;
+
+    memcpy(path, golden, dirlen);
+    strcpy(path+dirlen, file);
+    return path;
+}
+
+// 'path' made absolute against the working directory, with "." and ".."
+// taken out. symbolic links are left as they are.
+static char* verify_abspath(const char* path)
+{
+    char cwd[4096];
+    char* full;
+    char* out;
+    const char* p;
+    size_t len = 0, n;
+
+    cwd[0] = '\0';
+    if(path[0] != '/' && !getcwd(cwd, sizeof(cwd)))
+        return NULL;
+
+    full = malloc(strlen(cwd) + strlen(path) + 2);
+    out = malloc(strlen(cwd) + strlen(path) + 2);
+    if(!full || !out)
+    {
+        free(full);
+        free(out);
+        return NULL;
+    }
+    sprintf(full, "%s/%s", cwd, path);
+
+    for(p = full; *p; p += n)
+    {
+        while(*p == '/')
+            ++p;
+        n = strcspn(p, "/");
+
+        if(n == 0 || (n == 1 && p[0] == '.'))
+            continue;
+
+        if(n == 2 && p[0] == '.' && p[1] == '.')
+        {
+            while(len > 0 && out[len-1] != '/')
+                --len;
+            if(len > 0)
+                --len;
+            continue;
+        }
+
+        out[len++] = '/';
+        memcpy(out+len, p, n);
+        len += n;
+    }
+
+    if(len == 0)
+        out[len++] = '/';
+    out[len] = '\0';
+
+    free(full);
+    return out;
+}
+
+// the name verify_path() turns back into 'file', relative to the directory
+// of the golden file. NULL if the working directory is not known.
+static char* verify_relpath(const char* golden, const char* file)
+{
+    char* dir = verify_abspath(golden);
+    char* abs = verify_abspath(file);
+    char* rel = NULL;
+    size_t i, common = 0;
+    int ups = 0;
+
+    if(!dir || !abs)
+        goto relpath_done;
+
+    // the golden file's directory, "" for the root
+    *strrchr(dir, '/') = '\0';
+
+    // the last separator up to which both paths are the same
+    for(i = 0; dir[i] == abs[i] || (dir[i] == '\0' && abs[i] == '/'); ++i)
+    {
+        if(abs[i] == '/')
+            common = i;
+        if(dir[i] == '\0')
+            break;
+    }
+
+    for(i = common; dir[i]; ++i)
+    {
+        if(dir[i] == '/')
+            ++ups;
+    }
+
+    rel = malloc(3*ups + strlen(abs+common+1) + 1);
+    if(!rel)
+        goto relpath_done;
+
+    rel[0] = '\0';
+    while(ups-- > 0)
+        strcat(rel, "../");
+    strcat(rel, abs+common+1);
+
+relpath_done:
+    free(dir);
+    free(abs);
+    return rel;
+}
+
+// reads a golden file, returns NULL if it can not be read or has no songs
+struct verifyjob_s* verify_load(const char* golden, int* count)
+{
+    struct verifyjob_s* jobs = NULL;
+    struct verifyjob_s* grown;
+    FILE* file;
+    char line[1024];
+    unsigned long long hash;
+    int seconds, song, skip;
+    char synth;
+    size_t len;
+    int n = 0;
+
+    file = fopen(golden, "r");
+    if(!file)
+        return NULL;
+
+    while(fgets(line, sizeof(line), file))
+    {
+        len = strlen(line);
+        while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = '\0';
+
+        if(len == 0 || line[0] == '#')
+            continue;
+
+        if(sscanf(line, "%llx %d %d %c %n", &hash, &seconds, &song, &synth, &skip) < 4 || line[skip] == '\0')
+        {
+            fprintf(stderr, "%s: bad line \'%s\'\n", golden, line);
+            continue;
+        }
+
+        grown = realloc(jobs, (n+1)*sizeof(struct verifyjob_s));
+        if(!grown)
+            break;
+        jobs = grown;
+
+        memset(&jobs[n], 0, sizeof(struct verifyjob_s));
+        jobs[n].nsffile = verify_path(golden, line+skip);
+        if(!jobs[n].nsffile)
+            break;
+        jobs[n].song = song;
+        jobs[n].seconds = seconds;
+        jobs[n].synthesis = (synth == 'b') ? APU_SYNTH_BLEP : APU_SYNTH_POINT;
+        jobs[n].expected = hash;
+        jobs[n].maxdiff = -1;
+        ++n;
+    }
+
+    fclose(file);
+
+    if(n == 0)
+    {
+        free(jobs);
+        return NULL;
+    }
+
+    *count = n;
+    return jobs;
+}
+
+// file names are written relative to the golden file, as verify_load()
+// reads them
+int verify_save(const char* golden, const struct verifyjob_s* jobs, int count)
+{
+    FILE* file;
+    char* name;
+    int i;
+
+    file = fopen(golden, "w");
+    if(!file)
+        return 0;
+
+    fprintf(file, "# hash seconds song synthesis file\n");
+    for(i = 0; i < count; ++i)
+    {
+        if(!jobs[i].result)
+            continue;
+
+        name = verify_relpath(golden, jobs[i].nsffile);
+        fprintf(file, "%016llx %d %d %c %s\n", (unsigned long long)jobs[i].hash, jobs[i].seconds, jobs[i].song,
+                (jobs[i].synthesis == APU_SYNTH_BLEP) ? 'b' : 'p', name ? name : jobs[i].nsffile);
+        free(name);
+    }
+
+    return fclose(file) == 0;
+}
+
+void verify_freejobs(struct verifyjob_s* jobs, int count)
+{
+    int i;
+
+    if(jobs == NULL)
+        return;
+
+    for(i = 0; i < count; ++i)
+        free(jobs[i].nsffile);
+    free(jobs);
+}
+
+// largest difference between 'buffer' and the next 'frames' samples of the
+// reference, or -1 once the reference has run out
+static int verify_diff(FILE* ref, const int16_t* buffer, int16_t* scratch, uint32_t frames)
+{
+    size_t got;
+    int diff, maxdiff = 0;
+    uint32_t i;
+
+    got = fread(scratch, sizeof(int16_t), frames, ref);
+    if(got < frames)
+        return -1;
+
+    for(i = 0; i < frames; ++i)
+    {
+        diff = abs((int)buffer[i] - (int)scratch[i]);
+        if(diff > maxdiff)
+            maxdiff = diff;
+    }
+
+    return maxdiff;
+}
+
+static void verify_song(struct verifyjob_s* job, const char* refdir)
+{
+    struct nsf_s* nsf;
+    int16_t* buffer = NULL;
+    int16_t* scratch = NULL;
+    FILE* ref = NULL;
+    char* refname;
+    uint32_t total = (uint32_t)job->seconds*VERIFY_RATE;
+    uint32_t done = 0;
+    int len, diff;
+
+    job->result = 0;
+    job->hash = VERIFY_FNVINIT;
+    job->maxdiff = -1;
+
+    nsf = nsf_open(job->nsffile, VERIFY_RATE, NULL);
+    if(!nsf)
+        return;
+
+    nsf_setsynthesis(nsf, job->synthesis);
+    if(!nsf_init(nsf, job->song-1))
+        goto song_done;
+
+    len = nsf_playsamples(nsf)*4;
+    buffer = malloc(len*sizeof(int16_t));
+    scratch = malloc(len*sizeof(int16_t));
+    if(!buffer || !scratch)
+        goto song_done;
+
+    // what "tinynsf -r -d refdir" wrote for this song
+    if(refdir)
+    {
+        refname = render_outname(job->nsffile, job->song, refdir, WAV_FORMAT_RAW);
+        if(refname)
+        {
+            ref = fopen(refname, "rb");
+            free(refname);
+        }
+        if(ref)
+            job->maxdiff = 0;
+    }
+
+    while(done < total)
+    {
+        if(total - done < (uint32_t)len)
+            len = total - done;
+
+        nsf_render(nsf, buffer, len);
+        job->hash = verify_hash(job->hash, buffer, len);
+
+        if(ref && job->maxdiff >= 0)
+        {
+            diff = verify_diff(ref, buffer, scratch, len);
+            if(diff < 0 || diff > job->maxdiff)
+                job->maxdiff = diff;
+        }
+
+        done += len;
+    }
+
+    job->result = 1;
+
+song_done:
+    if(ref)
+        fclose(ref);
+    free(scratch);
+    free(buffer);
+    nsf_close(nsf);
+}
+
+struct verifyshared_s
+{
+    struct verifyjob_s* jobs;
+    int count;
+    int next;
+    const char* refdir;
+    pthread_mutex_t lock;
+};
+
+static void* verify_thread(void* param)
+{
+    struct verifyshared_s* shared = param;
+    int job;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&shared->lock);
+        job = shared->next++;
+        pthread_mutex_unlock(&shared->lock);
+
+        if(job >= shared->count)
+            break;
+
+        verify_song(&shared->jobs[job], shared->refdir);
+    }
+
+    return NULL;
+}
+
+// renders and hashes every job on 'threads' threads. with 'refdir' set the
+// output is also compared sample by sample to the raw files there.
+// returns the number of songs that could not be rendered.
+int verify_run(struct verifyjob_s* jobs, int count, int threads, const char* refdir)
+{
+    struct verifyshared_s shared;
+    pthread_t* pool;
+    int started = 0;
+    int failed = 0;
+    int i;
+
+    if(threads < 1)
+        threads = 1;
+    if(threads > count)
+        threads = count;
+
+    shared.jobs = jobs;
+    shared.count = count;
+    shared.next = 0;
+    shared.refdir = refdir;
+    pthread_mutex_init(&shared.lock, NULL);
+
+    pool = malloc(threads*sizeof(pthread_t));
+    if(pool)
+    {
+        for(started = 0; started < threads; ++started)
+        {
+            if(pthread_create(&pool[started], NULL, verify_thread, &shared) != 0)
+                break;
+        }
+    }
+
+    // no threads at all still gets the work done
+    if(started == 0)
+        verify_thread(&shared);
+
+    for(i = 0; i < started; ++i)
+        pthread_join(pool[i], NULL);
+
+    free(pool);
+    pthread_mutex_destroy(&shared.lock);
+
+    for(i = 0; i < count; ++i)
+    {
+        if(!jobs[i].result)
+            ++failed;
+    }
+
+    return failed;
+}
@@ -0,0 +1,36 @@
+#ifndef VERIFY_H_INCLUDED
+#define VERIFY_H_INCLUDED
+
+#include "M6502/M6502.h"
+#include <stdint.h>
+
+// Golden output checks. Every song is rendered headless for a fixed time and
+// its PCM hashed, so that any change to the emulation shows up as a changed
+// hash. A golden file holds one line per song:
+//
+//   <64 bit hash in hex> <seconds> <song, 1 based> <p|b synthesis> <file>
+//
+// with file names relative to the golden file's directory, as verify_save()
+// writes them.
+
+struct verifyjob_s
+{
+    char* nsffile;
+    int song;               // 1 based
+    int seconds;
+    byte synthesis;         // APU_SYNTH_*
+    uint64_t expected;      // from the golden file
+    uint64_t hash;          // of this run
+    int maxdiff;            // largest sample difference to the reference, -1 if none
+    int result;             // 1 if the song could be rendered
+};
+
+uint64_t verify_hash(uint64_t hash, const int16_t* buffer, uint32_t frames);
+
+struct verifyjob_s* verify_load(const char* golden, int* count);
+int verify_save(const char* golden, const struct verifyjob_s* jobs, int count);
+void verify_freejobs(struct verifyjob_s* jobs, int count);
+
+int verify_run(struct verifyjob_s* jobs, int count, int threads, const char* refdir);
+
+#endif // VERIFY_H_INCLUDED
@@ -0,0 +1,253 @@
+#include "vrc6.h"
+#include "square.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define VRC6_PULSE1     0x9000
+#define VRC6_FREQCTRL   0x9003
+#define VRC6_PULSE2     0xA000
+#define VRC6_SAW        0xB000
+
+// one step of the summed channel levels, pulses are 0-15 each and the saw
+// 0-31. a full volume pulse comes out a little quieter than a 2A03 one.
+#define VRC6_LEVEL      (1<<25)
+
+struct vrc6pulse_s
+{
+    struct square_s timer;  // the low 4 bits of its step count the duty phase down
+    byte mode;              // constant volume, ignores the duty
+    byte duty;              // high while the duty phase is at most this
+    byte volume;
+    byte enabled;
+    word period;            // 12 bit, the timer steps every (period>>shift)+1 cycles
+};
+
+struct vrc6saw_s
+{
+    struct square_s timer;
+    byte rate;              // added to the accumulator every other step
+    byte enabled;
+    word period;            // as for the pulses
+    byte step;              // 0-13, the accumulator restarts at 14
+    byte accum;
+};
+
+struct vrc6_s
+{
+    struct vrc6pulse_s pulse[2];
+    struct vrc6saw_s saw;
+    byte halt;
+    byte shift;         // of all periods, from $9003
+};
+
+// the timer counts from the period down to 0 and then reloads, so a new
+// period only takes effect once the count in progress has run out
+static inline void vrc6_setperiod(struct square_s* timer, word period, byte shift)
+{
+    timer->period = (period>>shift) + 1;
+}
+
+static void vrc6_pulse_run(struct vrc6pulse_s* p, uint32_t cycles)
+{
+    if(p->enabled)
+        square_run(&p->timer, cycles);
+}
+
+static void vrc6_saw_run(struct vrc6saw_s* s, uint32_t cycles)
+{
+    uint32_t steps, end;
+
+    if(!s->enabled)
+        return;
+
+    steps = square_run(&s->timer, cycles);
+    if(!steps)
+        return;
+
+    end = s->step + steps;
+    if(end < 14)
+    {
+        // every even step adds the rate
+        s->accum += s->rate * ((end>>1) - (s->step>>1));
+        s->step = end;
+    }
+    else
+    {
+        // what is left after the last restart
+        s->step = end % 14;
+        s->accum = s->rate * (s->step>>1);
+    }
+}
+
+static void* vrc6_init(uint32_t cpu_clock)
+{
+    return calloc(1, sizeof(struct vrc6_s));
+}
+
+static void vrc6_cleanup(void* chip)
+{
+    free(chip);
+}
+
+static void vrc6_reset(void* chip)
+{
+    struct vrc6_s* vrc6 = chip;
+
+    memset(vrc6, 0, sizeof(struct vrc6_s));
+    square_reset(&vrc6->pulse[0].timer, 1);
+    square_reset(&vrc6->pulse[1].timer, 1);
+    square_reset(&vrc6->saw.timer, 1);
+}
+
+static void vrc6_pulse_write(struct vrc6pulse_s* p, byte shift, byte reg, byte data)
+{
+    switch(reg)
+    {
+        case 0:
+            p->mode = BIT(data, 7);
+            p->duty = (data>>4)&0x07;
+            p->volume = data&0x0F;
+            break;
+        case 1:
+            p->period = (p->period&0xF00) | data;
+            vrc6_setperiod(&p->timer, p->period, shift);
+            break;
+        case 2:
+            p->period = (p->period&0x0FF) | ((data&0x0F)<<8);
+            vrc6_setperiod(&p->timer, p->period, shift);
+            p->enabled = BIT(data, 7);
+            if(!p->enabled)
+                p->timer.step = 0;
+            break;
+    }
+}
+
+static void vrc6_saw_write(struct vrc6saw_s* s, byte shift, byte reg, byte data)
+{
+    switch(reg)
+    {
+        case 0:
+            s->rate = data&0x3F;
+            break;
+        case 1:
+            s->period = (s->period&0xF00) | data;
+            vrc6_setperiod(&s->timer, s->period, shift);
+            break;
+        case 2:
+            s->period = (s->period&0x0FF) | ((data&0x0F)<<8);
+            vrc6_setperiod(&s->timer, s->period, shift);
+            s->enabled = BIT(data, 7);
+            if(!s->enabled)
+            {
+                s->step = 0;
+                s->accum = 0;
+            }
+            break;
+    }
+}
+
+static int vrc6_write(void* chip, word addr, byte data)
+{
+    struct vrc6_s* vrc6 = chip;
+    byte reg = addr&0x0FFF;
+
+    if((addr&0x0FFF) > 3)
+        return 0;
+
+    switch(addr&0xF000)
+    {
+        case VRC6_PULSE1:
+            if(addr == VRC6_FREQCTRL)
+            {
+                vrc6->halt = BIT(data, 0);
+                vrc6->shift = BIT(data, 2) ? 8 : 0;
+                if(BIT(data, 1))
+                    vrc6->shift = 4;
+                vrc6_setperiod(&vrc6->pulse[0].timer, vrc6->pulse[0].period, vrc6->shift);
+                vrc6_setperiod(&vrc6->pulse[1].timer, vrc6->pulse[1].period, vrc6->shift);
+                vrc6_setperiod(&vrc6->saw.timer, vrc6->saw.period, vrc6->shift);
+            }
+            else
+                vrc6_pulse_write(&vrc6->pulse[0], vrc6->shift, reg, data);
+            return 1;
+        case VRC6_PULSE2:
+            vrc6_pulse_write(&vrc6->pulse[1], vrc6->shift, reg, data);
+            return 1;
+        case VRC6_SAW:
+            vrc6_saw_write(&vrc6->saw, vrc6->shift, reg, data);
+            return 1;
+    }
+
+    return 0;
+}
+
+static int vrc6_read(void* chip, word addr)
+{
+    return -1;  // write only
+}
+
+static void vrc6_process(void* chip, uint32_t cycles)
+{
+    struct vrc6_s* vrc6 = chip;
+
+    if(vrc6->halt)
+        return;
+
+    vrc6_pulse_run(&vrc6->pulse[0], cycles);
+    vrc6_pulse_run(&vrc6->pulse[1], cycles);
+    vrc6_saw_run(&vrc6->saw, cycles);
+}
+
+static inline int32_t vrc6_pulse_level(const struct vrc6pulse_s* p)
+{
+    if(!p->enabled)
+        return 0;
+
+    if(p->mode || 15 - (p->timer.step&15) <= p->duty)
+        return p->volume;
+
+    return 0;
+}
+
+static int32_t vrc6_output(void* chip)
+{
+    struct vrc6_s* vrc6 = chip;
+    int32_t level;
+
+    level = vrc6_pulse_level(&vrc6->pulse[0]) + vrc6_pulse_level(&vrc6->pulse[1]);
+    if(vrc6->saw.enabled)
+        level += vrc6->saw.accum>>3;
+
+    return level * VRC6_LEVEL;
+}
+
+static const char* const vrc6_stemnames[] =
+{
+    "VRC6 pulse1", "VRC6 pulse2", "VRC6 saw", NULL
+};
+
+static void vrc6_stems(void* chip, int32_t* levels)
+{
+    struct vrc6_s* vrc6 = chip;
+
+    levels[0] = vrc6_pulse_level(&vrc6->pulse[0]) * VRC6_LEVEL;
+    levels[1] = vrc6_pulse_level(&vrc6->pulse[1]) * VRC6_LEVEL;
+    levels[2] = vrc6->saw.enabled ? (vrc6->saw.accum>>3) * VRC6_LEVEL : 0;
+}
+
+const apumapper_t vrc6_mapper =
+{
+    "VRC6",
+    vrc6_init,
+    vrc6_cleanup,
+    vrc6_reset,
+    vrc6_write,
+    vrc6_read,
+    0,
+    0,
+    vrc6_process,
+    vrc6_output,
+    NULL,
+    vrc6_stemnames,
+    vrc6_stems,
+};
@@ -0,0 +1,10 @@
+#ifndef VRC6_H_INCLUDED
+#define VRC6_H_INCLUDED
+
+#include "apu.h"
+
+// Konami VRC6: two pulse channels with 8 duty settings and 4 bit volume,
+// and a sawtooth, at $9000-$9003, $A000-$A002 and $B000-$B002.
+extern const apumapper_t vrc6_mapper;
+
+#endif // VRC6_H_INCLUDED
@@ -0,0 +1,548 @@
+#include "vrc7.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define VRC7_SELECT     0x9010
+#define VRC7_DATA       0x9030
+
+// registers behind VRC7_DATA
+#define VRC7_CUSTOM     0x00    // 8 bytes, the custom instrument
+#define VRC7_FNUM       0x10    // 6 channels each
+#define VRC7_KEY        0x20    // fnum bit 8, block, key on and sustain
+#define VRC7_INSTVOL    0x30    // instrument and volume
+
+#define VRC7_CHANNELS   6
+#define VRC7_RATE       36      // CPU cycles per FM sample, 3.58MHz/72
+#define VRC7_BLOCK      64      // FM samples rendered at once, at most
+
+// a full volume channel swings about as far as a full 2A03 pulse
+#define VRC7_LEVEL      (1<<16)
+
+// the envelope counts 128 steps of 0.375dB, with 15 fractional bits
+#define EG_SHIFT        15
+#define EG_FULL         (128<<EG_SHIFT)
+
+#define PG_MASK         0x7FFFF // phase, 10 bit sine index and 9 bits below
+
+// 3.7Hz tremolo and 6.4Hz vibrato, as 32 bit phase steps per FM sample
+#define AM_STEP         319647
+#define PM_STEP         552906
+
+enum
+{
+    EG_ATTACK,
+    EG_DECAY,
+    EG_SUSHOLD,     // sustained instruments hold the sustain level while keyed
+    EG_SUSTAIN,     // percussive ones keep decaying at the release rate
+    EG_RELEASE,
+    EG_OFF
+};
+
+// the instruments of the VRC7, as read from the chip
+static const byte vrc7_patches[16][8] =
+{
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },    // custom
+    { 0x03, 0x21, 0x05, 0x06, 0xE8, 0x81, 0x42, 0x27 },    // buzzy bell
+    { 0x13, 0x41, 0x14, 0x0D, 0xD8, 0xF6, 0x23, 0x12 },    // guitar
+    { 0x11, 0x11, 0x08, 0x08, 0xFA, 0xB2, 0x20, 0x12 },    // wurly
+    { 0x31, 0x61, 0x0C, 0x07, 0xA8, 0x64, 0x61, 0x27 },    // flute
+    { 0x32, 0x21, 0x1E, 0x06, 0xE1, 0x76, 0x01, 0x28 },    // clarinet
+    { 0x02, 0x01, 0x06, 0x00, 0xA3, 0xE2, 0xF4, 0xF4 },    // synth
+    { 0x21, 0x61, 0x1D, 0x07, 0x82, 0x81, 0x11, 0x07 },    // trumpet
+    { 0x23, 0x21, 0x22, 0x17, 0xA2, 0x72, 0x01, 0x17 },    // organ
+    { 0x35, 0x11, 0x25, 0x00, 0x40, 0x73, 0x72, 0x01 },    // bells
+    { 0xB5, 0x01, 0x0F, 0x0F, 0xA8, 0xA5, 0x51, 0x02 },    // vibes
+    { 0x17, 0xC1, 0x24, 0x07, 0xF8, 0xF8, 0x22, 0x12 },    // vibraphone
+    { 0x71, 0x23, 0x11, 0x06, 0x65, 0x74, 0x18, 0x16 },    // tutti
+    { 0x01, 0x02, 0xD3, 0x05, 0xC9, 0x95, 0x03, 0x02 },    // fretless
+    { 0x61, 0x63, 0x0C, 0x00, 0x94, 0xC0, 0x33, 0xF6 },    // synth bass
+    { 0x21, 0x72, 0x0D, 0x00, 0xC1, 0xD5, 0x56, 0x06 },    // sweep
+};
+
+// twice the frequency multiplier of each MULT setting
+static const byte vrc7_mult2[16] = { 1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30 };
+
+// key scaling of fnum bits 5-8 in 0.75dB steps, before the block is taken off
+static const byte vrc7_kslbase[16] = { 0, 24, 32, 37, 40, 43, 45, 47, 48, 50, 51, 52, 53, 54, 55, 56 };
+
+// shared by every instance, made once
+static uint16_t vrc7_logsin[256];       // -log2 of a quarter sine, 8 fractional bits
+static uint16_t vrc7_exp[256];          // 2^-(i/256), 12 bits
+static byte vrc7_attack[128];           // attack curve, by envelope step
+static byte vrc7_am[256];               // tremolo, in envelope steps
+static int16_t vrc7_pm[256];            // vibrato, in 1/65536ths of the frequency
+static uint32_t vrc7_ar[16][16];        // envelope steps per FM sample, by rate and key scale
+static uint32_t vrc7_dr[16][16];
+static pthread_once_t vrc7_tables_once = PTHREAD_ONCE_INIT;
+
+struct vrc7op_s
+{
+    // from the instrument, the frequency and the volume
+    byte am;
+    byte vib;
+    byte sustained;     // EG type
+    byte wave;          // half sine
+    byte ar, dr, rr;
+    uint32_t sl;        // in envelope units
+    uint32_t inc;       // phase step
+    int32_t level;      // total level and key scaling, envelope steps
+    byte rks;
+
+    uint32_t phase;
+    byte state;         // EG_*
+    uint32_t eg;
+    uint32_t egstep;
+    int32_t out[2];     // last two outputs, for the modulator's feedback
+};
+
+struct vrc7_s
+{
+    byte select;
+    byte custom[8];
+
+    struct vrc7ch_s
+    {
+        word fnum;          // 9 bit
+        byte block;
+        byte key;
+        byte sustain;
+        byte inst;
+        byte volume;
+        byte feedback;
+        struct vrc7op_s op[2];  // modulator, carrier
+        int32_t out;            // last FM sample, for the stems
+    }ch[VRC7_CHANNELS];
+
+    uint32_t amphase;
+    uint32_t pmphase;
+
+    // FM samples since the last output sample, averaged into it
+    uint32_t cycles;
+    int64_t sum;
+    uint32_t count;
+    int32_t last;
+};
+
+static void vrc7_make_tables(void)
+{
+    int i, r, k, rm, rl;
+
+    for(i = 0; i < 256; ++i)
+    {
+        vrc7_logsin[i] = (uint16_t)floor(-log2(sin((i + 0.5) * M_PI / 512.0)) * 256.0 + 0.5);
+        vrc7_exp[i] = (uint16_t)floor(pow(2.0, -i / 256.0) * 4096.0 + 0.5);
+        vrc7_am[i] = (byte)floor(13.0 * (1.0 - fabs(i - 128.0) / 128.0) + 0.5);
+        vrc7_pm[i] = (int16_t)floor((pow(2.0, 14.0/1200.0) - 1.0) * 65536.0 * sin(2.0 * M_PI * i / 256.0) + 0.5);
+    }
+
+    // the attack moves along a log curve, fast at first
+    vrc7_attack[0] = 127;
+    for(i = 1; i < 128; ++i)
+        vrc7_attack[i] = (byte)(127.0 - 127.0 * log(i) / log(127.0));
+
+    for(r = 0; r < 16; ++r)
+    {
+        for(k = 0; k < 16; ++k)
+        {
+            rm = r + (k>>2);
+            rl = k&3;
+            if(rm > 15)
+                rm = 15;
+
+            // rate 0 never moves, attack rate 15 is immediate
+            vrc7_ar[r][k] = (r == 0 || r == 15) ? 0 : (3 * (rl + 4)) << (rm + 1);
+            vrc7_dr[r][k] = (r == 0) ? 0 : (rl + 4) << (rm - 1);
+        }
+    }
+}
+
+static void* vrc7_init(uint32_t cpu_clock)
+{
+    pthread_once(&vrc7_tables_once, vrc7_make_tables);
+
+    return calloc(1, sizeof(struct vrc7_s));
+}
+
+static void vrc7_cleanup(void* chip)
+{
+    free(chip);
+}
+
+static void vrc7_reset(void* chip)
+{
+    struct vrc7_s* vrc7 = chip;
+    int c;
+
+    memset(vrc7, 0, sizeof(struct vrc7_s));
+    for(c = 0; c < VRC7_CHANNELS; ++c)
+    {
+        vrc7->ch[c].op[0].state = EG_OFF;
+        vrc7->ch[c].op[0].eg = EG_FULL;
+        vrc7->ch[c].op[1].state = EG_OFF;
+        vrc7->ch[c].op[1].eg = EG_FULL;
+    }
+}
+
+static uint32_t vrc7_egstep(const struct vrc7ch_s* ch, const struct vrc7op_s* op)
+{
+    switch(op->state)
+    {
+        case EG_ATTACK:
+            return vrc7_ar[op->ar][op->rks];
+        case EG_DECAY:
+            return vrc7_dr[op->dr][op->rks];
+        case EG_SUSTAIN:
+            return vrc7_dr[op->rr][op->rks];
+        case EG_RELEASE:
+            if(ch->sustain)
+                return vrc7_dr[5][op->rks];
+            return vrc7_dr[op->sustained ? op->rr : 7][op->rks];
+    }
+
+    return 0;
+}
+
+// work out everything the instrument, frequency and volume decide, so that
+// rendering only steps the phases and envelopes
+static void vrc7_update(struct vrc7_s* vrc7, struct vrc7ch_s* ch)
+{
+    const byte* patch = ch->inst ? vrc7_patches[ch->inst] : vrc7->custom;
+    struct vrc7op_s* op;
+    int32_t ksl;
+    int i;
+
+    ch->feedback = patch[3]&0x07;
+
+    for(i = 0; i < 2; ++i)
+    {
+        op = &ch->op[i];
+
+        op->am = BIT(patch[i], 7);
+        op->vib = BIT(patch[i], 6);
+        op->sustained = BIT(patch[i], 5);
+        op->rks = BIT(patch[i], 4) ? (ch->block<<1) | (ch->fnum>>8) : ch->block>>1;
+        op->inc = ((ch->fnum << ch->block) * vrc7_mult2[patch[i]&0x0F]) >> 1;
+        op->wave = BIT(patch[3], (3+i));
+        op->ar = patch[4+i]>>4;
+        op->dr = patch[4+i]&0x0F;
+        op->sl = ((patch[6+i]>>4) * 8) << EG_SHIFT;
+        op->rr = patch[6+i]&0x0F;
+
+        // key scaling, in envelope steps of 0.375dB
+        ksl = 0;
+        if(patch[2+i]>>6)
+        {
+            ksl = vrc7_kslbase[ch->fnum>>5]*2 - 16*(7 - ch->block);
+            ksl = (ksl > 0) ? ksl >> (3 - (patch[2+i]>>6)) : 0;
+        }
+
+        // the modulator has the total level, the carrier the volume
+        if(i == 0)
+            op->level = (patch[2]&0x3F)*2 + ksl;
+        else
+            op->level = ch->volume*8 + ksl;
+
+        op->egstep = vrc7_egstep(ch, op);
+    }
+}
+
+static void vrc7_keyon(struct vrc7ch_s* ch)
+{
+    int i;
+
+    for(i = 0; i < 2; ++i)
+    {
+        ch->op[i].phase = 0;
+        ch->op[i].state = EG_ATTACK;
+        ch->op[i].eg = 0;
+        ch->op[i].egstep = vrc7_egstep(ch, &ch->op[i]);
+    }
+}
+
+static void vrc7_keyoff(struct vrc7ch_s* ch)
+{
+    struct vrc7op_s* op;
+    int i;
+
+    for(i = 0; i < 2; ++i)
+    {
+        op = &ch->op[i];
+        if(op->state == EG_OFF)
+            continue;
+
+        // release from where the attack got to
+        if(op->state == EG_ATTACK)
+            op->eg = vrc7_attack[op->eg>>EG_SHIFT] << EG_SHIFT;
+
+        op->state = EG_RELEASE;
+        op->egstep = vrc7_egstep(ch, op);
+    }
+}
+
+static int vrc7_write(void* chip, word addr, byte data)
+{
+    struct vrc7_s* vrc7 = chip;
+    struct vrc7ch_s* ch;
+    byte reg, key;
+    int c;
+
+    if(addr == VRC7_SELECT)
+    {
+        vrc7->select = data;
+        return 1;
+    }
+
+    if(addr != VRC7_DATA)
+        return 0;
+
+    reg = vrc7->select;
+
+    if(reg < 8)
+    {
+        vrc7->custom[reg] = data;
+        for(c = 0; c < VRC7_CHANNELS; ++c)
+        {
+            if(vrc7->ch[c].inst == 0)
+                vrc7_update(vrc7, &vrc7->ch[c]);
+        }
+        return 1;
+    }
+
+    if((reg&0x0F) >= VRC7_CHANNELS)
+        return 1;
+    ch = &vrc7->ch[reg&0x0F];
+
+    switch(reg&0xF0)
+    {
+        case VRC7_FNUM:
+            ch->fnum = (ch->fnum&0x100) | data;
+            break;
+        case VRC7_KEY:
+            ch->fnum = (ch->fnum&0x0FF) | ((data&0x01)<<8);
+            ch->block = (data>>1)&0x07;
+            ch->sustain = BIT(data, 5);
+            key = BIT(data, 4);
+            if(key && !ch->key)
+                vrc7_keyon(ch);
+            else
+            if(!key && ch->key)
+                vrc7_keyoff(ch);
+            ch->key = key;
+            break;
+        case VRC7_INSTVOL:
+            ch->inst = data>>4;
+            ch->volume = data&0x0F;
+            break;
+        default:
+            return 1;
+    }
+
+    vrc7_update(vrc7, ch);
+    return 1;
+}
+
+static int vrc7_read(void* chip, word addr)
+{
+    return -1;  // write only
+}
+
+// one envelope step, returns the attenuation in 0.375dB steps
+static inline int32_t vrc7_envelope(const struct vrc7ch_s* ch, struct vrc7op_s* op)
+{
+    switch(op->state)
+    {
+        case EG_ATTACK:
+            op->eg += op->egstep;
+            if(op->eg >= EG_FULL || op->ar == 15)
+            {
+                op->eg = 0;
+                op->state = EG_DECAY;
+                op->egstep = vrc7_egstep(ch, op);
+                return 0;
+            }
+            return vrc7_attack[op->eg>>EG_SHIFT];
+        case EG_DECAY:
+            op->eg += op->egstep;
+            if(op->eg >= op->sl)
+            {
+                op->eg = op->sl;
+                op->state = op->sustained ? EG_SUSHOLD : EG_SUSTAIN;
+                op->egstep = vrc7_egstep(ch, op);
+            }
+            break;
+        case EG_SUSTAIN:
+        case EG_RELEASE:
+            op->eg += op->egstep;
+            if(op->eg >= EG_FULL)
+            {
+                op->eg = EG_FULL;
+                op->state = EG_OFF;
+            }
+            break;
+        case EG_OFF:
+            return 127;
+    }
+
+    return op->eg>>EG_SHIFT;
+}
+
+// sine at the 10 bit 'index', attenuated by 'att' 0.375dB steps
+static inline int32_t vrc7_sine(int32_t index, int32_t att, byte halfwave)
+{
+    uint32_t x;
+    int32_t out;
+
+    if((index & 0x200) && halfwave)
+        return 0;
+
+    x = vrc7_logsin[(index & 0x100) ? 0xFF - (index & 0xFF) : (index & 0xFF)] + (att<<4);
+    if(x >= (13<<8))
+        return 0;
+
+    out = vrc7_exp[x & 0xFF] >> (x >> 8);
+    return (index & 0x200) ? -out : out;
+}
+
+static inline uint32_t vrc7_phase(struct vrc7op_s* op, int32_t pm)
+{
+    uint32_t inc = op->inc;
+
+    if(op->vib)
+        inc += ((int64_t)inc * pm) >> 16;
+
+    op->phase = (op->phase + inc) & PG_MASK;
+    return op->phase >> 9;
+}
+
+// render 'count' FM samples channel by channel, added to 'mix'
+static void vrc7_render(struct vrc7_s* vrc7, int32_t* mix, int count)
+{
+    int32_t am[VRC7_BLOCK];
+    int32_t pm[VRC7_BLOCK];
+    struct vrc7ch_s* ch;
+    struct vrc7op_s* mod;
+    struct vrc7op_s* car;
+    int32_t index, fb, out, sample;
+    int c, i;
+
+    for(i = 0; i < count; ++i)
+    {
+        am[i] = vrc7_am[vrc7->amphase>>24];
+        pm[i] = vrc7_pm[vrc7->pmphase>>24];
+        vrc7->amphase += AM_STEP;
+        vrc7->pmphase += PM_STEP;
+        mix[i] = 0;
+    }
+
+    for(c = 0; c < VRC7_CHANNELS; ++c)
+    {
+        ch = &vrc7->ch[c];
+        mod = &ch->op[0];
+        car = &ch->op[1];
+
+        // nothing to hear until the next key on
+        if(car->state == EG_OFF)
+        {
+            ch->out = 0;
+            continue;
+        }
+
+        sample = 0;
+        for(i = 0; i < count; ++i)
+        {
+            fb = ch->feedback ? (mod->out[0] + mod->out[1]) >> (9 - ch->feedback) : 0;
+            index = vrc7_phase(mod, pm[i]) + fb;
+            out = vrc7_envelope(ch, mod) + mod->level + (mod->am ? am[i] : 0);
+            mod->out[1] = mod->out[0];
+            mod->out[0] = vrc7_sine(index, out, mod->wave);
+
+            index = vrc7_phase(car, pm[i]) + mod->out[0];
+            out = vrc7_envelope(ch, car) + car->level + (car->am ? am[i] : 0);
+            sample = vrc7_sine(index, out, car->wave);
+            mix[i] += sample;
+        }
+        ch->out = sample;
+    }
+}
+
+static void vrc7_process(void* chip, uint32_t cycles)
+{
+    struct vrc7_s* vrc7 = chip;
+    int32_t mix[VRC7_BLOCK];
+    uint32_t samples, count, i;
+
+    vrc7->cycles += cycles;
+    samples = vrc7->cycles / VRC7_RATE;
+    vrc7->cycles %= VRC7_RATE;
+
+    while(samples > 0)
+    {
+        count = (samples < VRC7_BLOCK) ? samples : VRC7_BLOCK;
+        vrc7_render(vrc7, mix, count);
+
+        for(i = 0; i < count; ++i)
+            vrc7->sum += mix[i];
+        vrc7->count += count;
+        vrc7->last = mix[count-1];
+
+        samples -= count;
+    }
+}
+
+// the FM samples since the last output sample averaged, which resamples
+// them to the output rate
+static int32_t vrc7_output(void* chip)
+{
+    struct vrc7_s* vrc7 = chip;
+    int64_t level = vrc7->last;
+
+    if(vrc7->count)
+    {
+        level = vrc7->sum / vrc7->count;
+        vrc7->sum = 0;
+        vrc7->count = 0;
+    }
+
+    level *= VRC7_LEVEL;
+    if(level > INT32_MAX)
+        return INT32_MAX;
+    if(level < INT32_MIN)
+        return INT32_MIN;
+
+    return (int32_t)level;
+}
+
+static const char* const vrc7_stemnames[] =
+{
+    "VRC7 ch1", "VRC7 ch2", "VRC7 ch3", "VRC7 ch4", "VRC7 ch5", "VRC7 ch6", NULL
+};
+
+// the last FM sample of each channel, where the output is their average
+// over the output sample
+static void vrc7_stems(void* chip, int32_t* levels)
+{
+    struct vrc7_s* vrc7 = chip;
+    int c;
+
+    for(c = 0; c < VRC7_CHANNELS; ++c)
+        levels[c] = vrc7->ch[c].out * VRC7_LEVEL;
+}
+
+const apumapper_t vrc7_mapper =
+{
+    "VRC7",
+    vrc7_init,
+    vrc7_cleanup,
+    vrc7_reset,
+    vrc7_write,
+    vrc7_read,
+    0,
+    0,
+    vrc7_process,
+    vrc7_output,
+    NULL,
+    vrc7_stemnames,
+    vrc7_stems,
+};
@@ -0,0 +1,11 @@
+#ifndef VRC7_H_INCLUDED
+#define VRC7_H_INCLUDED
+
+#include "apu.h"
+
+// Konami VRC7: a YM2413 (OPLL) cut down to six 2-operator FM channels and
+// 15 built-in instruments plus one custom one. Registers are selected by
+// writing their number to $9010 and then written at $9030.
+extern const apumapper_t vrc7_mapper;
+
+#endif // VRC7_H_INCLUDED
@@ -0,0 +1,118 @@
+#include "wav.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct wavfile_s
+{
+    FILE* file;
+    int format;
+    uint32_t samplerate;
+    int bits;
+    int channels;
+    uint32_t frames;        // frames written so far
+};
+
+static void wav_put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v&0xff;
+    p[1] = v>>8;
+}
+
+static void wav_put32(uint8_t* p, uint32_t v)
+{
+    p[0] = v&0xff;
+    p[1] = (v>>8)&0xff;
+    p[2] = (v>>16)&0xff;
+    p[3] = v>>24;
+}
+
+// (re)writes the 44 byte header, sizes are taken from the frames written
+static int wav_header(struct wavfile_s* wav)
+{
+    uint8_t head[44];
+    uint32_t blockalign = wav->channels*(wav->bits>>3);
+    uint32_t datasize = wav->frames*blockalign;
+
+    memcpy(head, "RIFF", 4);
+    wav_put32(head+4, 36 + datasize);
+    memcpy(head+8, "WAVEfmt ", 8);
+    wav_put32(head+16, 16);         // fmt chunk size
+    wav_put16(head+20, 1);          // PCM
+    wav_put16(head+22, wav->channels);
+    wav_put32(head+24, wav->samplerate);
+    wav_put32(head+28, wav->samplerate*blockalign);
+    wav_put16(head+32, blockalign);
+    wav_put16(head+34, wav->bits);
+    memcpy(head+36, "data", 4);
+    wav_put32(head+40, datasize);
+
+    if(fseek(wav->file, 0, SEEK_SET) != 0)
+        return 0;
+
+    return fwrite(head, 1, sizeof(head), wav->file) == sizeof(head);
+}
+
+struct wavfile_s* wav_open(const char* filename, int format, uint32_t samplerate, int bits, int channels)
+{
+    struct wavfile_s* wav = malloc(sizeof(struct wavfile_s));
+
+    if(!wav) return NULL;
+
+    wav->file = fopen(filename, "wb");
+    if(!wav->file)
+    {
+        free(wav);
+        return NULL;
+    }
+
+    wav->format = format;
+    wav->samplerate = samplerate;
+    wav->bits = bits;
+    wav->channels = channels;
+    wav->frames = 0;
+
+    // header with zero sizes for now, it is patched up on close
+    if((format == WAV_FORMAT_WAV) && !wav_header(wav))
+    {
+        fclose(wav->file);
+        free(wav);
+        return NULL;
+    }
+
+    return wav;
+}
+
+int wav_write(struct wavfile_s* wav, const void* buffer, uint32_t frames)
+{
+    size_t framesize = wav->channels*(wav->bits>>3);
+
+    // samples are kept in host order, which is little endian on every
+    // target this is built for
+    if(fwrite(buffer, framesize, frames, wav->file) < frames)
+        return 0;
+
+    wav->frames += frames;
+    return 1;
+}
+
+uint32_t wav_frames(struct wavfile_s* wav)
+{
+    return wav->frames;
+}
+
+int wav_close(struct wavfile_s* wav)
+{
+    int ok = 1;
+
+    if(wav == NULL)
+        return 0;
+
+    if(wav->format == WAV_FORMAT_WAV)
+        ok = wav_header(wav);
+
+    if(fclose(wav->file) != 0)
+        ok = 0;
+
+    free(wav);
+    return ok;
+}
@@ -0,0 +1,17 @@
+#ifndef WAV_H_INCLUDED
+#define WAV_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define WAV_FORMAT_WAV 0    // RIFF WAVE, PCM
+#define WAV_FORMAT_RAW 1    // headerless little endian PCM
+
+struct wavfile_s;
+
+struct wavfile_s* wav_open(const char* filename, int format, uint32_t samplerate, int bits, int channels);
+int wav_write(struct wavfile_s* wav, const void* buffer, uint32_t frames);
+uint32_t wav_frames(struct wavfile_s* wav);
+int wav_close(struct wavfile_s* wav);
+
+#endif // WAV_H_INCLUDED